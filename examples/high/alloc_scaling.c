@@ -0,0 +1,95 @@
+/* Measures sh_alloc/sh_free throughput as the number of threads grows.
+ * Threads are created once and reused for every round, so that the
+ * high-level interface never sees more than `max_threads` threads.
+ * Pick the arena layout to test with SH_ARENA_LAYOUT as usual.
+ *
+ * USAGE: ./alloc_scaling [max_threads] [allocations_per_thread] [size] [sites]
+ */
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* From the high-level interface */
+void *sh_alloc(int id, size_t sz);
+void sh_free(void *ptr);
+
+static size_t allocations, size;
+static int sites, active_threads;
+static volatile int done;
+static pthread_barrier_t start_barrier, end_barrier;
+
+static double elapsed(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + ((end->tv_nsec - start->tv_nsec) / 1e9);
+}
+
+static void *worker(void *arg) {
+  int thread, site;
+  size_t i;
+  void *ptr;
+
+  thread = (int) (intptr_t) arg;
+  while(1) {
+    pthread_barrier_wait(&start_barrier);
+    if(done) {
+      break;
+    }
+    if(thread < active_threads) {
+      site = (thread % sites) + 1;
+      for(i = 0; i < allocations; i++) {
+        ptr = sh_alloc(site, size);
+        *((volatile char *) ptr) = 0;
+        sh_free(ptr);
+      }
+    }
+    pthread_barrier_wait(&end_barrier);
+  }
+
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int max_threads, i;
+  pthread_t *threads;
+  struct timespec start, end;
+  double seconds;
+
+  max_threads = (argc > 1) ? strtoimax(argv[1], NULL, 10) : 128;
+  allocations = (argc > 2) ? strtoumax(argv[2], NULL, 10) : 1000000;
+  size = (argc > 3) ? strtoumax(argv[3], NULL, 10) : 64;
+  sites = (argc > 4) ? strtoimax(argv[4], NULL, 10) : 1;
+  if((max_threads <= 0) || (sites <= 0) || !allocations || !size) {
+    fprintf(stderr, "USAGE: ./alloc_scaling [max_threads] [allocations_per_thread] [size] [sites]\n");
+    return 1;
+  }
+
+  pthread_barrier_init(&start_barrier, NULL, max_threads + 1);
+  pthread_barrier_init(&end_barrier, NULL, max_threads + 1);
+  threads = malloc(sizeof(pthread_t) * max_threads);
+  done = 0;
+  for(i = 0; i < max_threads; i++) {
+    pthread_create(&threads[i], NULL, &worker, (void *) (intptr_t) i);
+  }
+
+  printf("%8s %14s %14s\n", "threads", "seconds", "Mallocs/s");
+  for(active_threads = 1; active_threads <= max_threads; active_threads *= 2) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_barrier_wait(&start_barrier);
+    pthread_barrier_wait(&end_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    seconds = elapsed(&start, &end);
+    printf("%8d %14.3f %14.2f\n", active_threads, seconds,
+           (active_threads * allocations) / seconds / 1e6);
+  }
+
+  done = 1;
+  pthread_barrier_wait(&start_barrier);
+  for(i = 0; i < max_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  return 0;
+}
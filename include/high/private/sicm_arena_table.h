@@ -0,0 +1,136 @@
+#pragma once
+/* arena_table is a sparse table of arena_info pointers, indexed by an arena
+ * index. The index is a thread index shifted left by `thread_shift`, ORed with
+ * the arena's slot within that thread; the shared layouts just use one thread.
+ * Lookups go through a per-thread directory of fixed-size chunks, and the
+ * directories and chunks are allocated the first time an arena lands in them,
+ * so memory scales with the arenas that exist rather than with
+ * threads * arenas per thread.
+ *
+ * Lookups don't lock. Insertions must be serialized by the caller.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ARENA_CHUNK_SHIFT 10
+#define ARENA_CHUNK_SIZE  (1 << ARENA_CHUNK_SHIFT)
+#define ARENA_CHUNK_MASK  (ARENA_CHUNK_SIZE - 1)
+
+typedef arena_info **arena_chunk;
+
+typedef struct arena_table {
+  arena_chunk **threads;
+  int num_threads, slots_per_thread, thread_shift, chunks_per_thread;
+} arena_table;
+
+/* Iterates over the arenas in the table, in index order */
+#define arena_table_for(t, i, a) \
+  for((i) = arena_table_next((t), 0); \
+      ((i) >= 0) && (((a) = arena_table_get((t), (i))), 1); \
+      (i) = arena_table_next((t), (i) + 1))
+
+static inline void arena_table_init(arena_table *t, int num_threads, int slots_per_thread) {
+  t->num_threads = num_threads;
+  t->slots_per_thread = slots_per_thread;
+  t->thread_shift = 0;
+  while((1L << t->thread_shift) < slots_per_thread) {
+    t->thread_shift++;
+  }
+  if(((long) num_threads << t->thread_shift) > (1L << 31)) {
+    fprintf(stderr, "Too many threads and arenas per thread for the arena table. Aborting.\n");
+    exit(1);
+  }
+  t->chunks_per_thread = ((1 << t->thread_shift) + ARENA_CHUNK_MASK) >> ARENA_CHUNK_SHIFT;
+  t->threads = (arena_chunk **) calloc(num_threads, sizeof(arena_chunk *));
+}
+
+/* Gets the index of a thread's slot */
+static inline int arena_table_index(arena_table *t, int thread, int slot) {
+  return (thread << t->thread_shift) | slot;
+}
+
+/* Gets the arena at an index, or NULL if there isn't one */
+static inline arena_info *arena_table_get(arena_table *t, int index) {
+  arena_chunk *dir;
+  arena_chunk chunk;
+  int slot;
+
+  dir = __atomic_load_n(&t->threads[index >> t->thread_shift], __ATOMIC_ACQUIRE);
+  if(!dir) {
+    return NULL;
+  }
+  slot = index & ((1 << t->thread_shift) - 1);
+  chunk = __atomic_load_n(&dir[slot >> ARENA_CHUNK_SHIFT], __ATOMIC_ACQUIRE);
+  if(!chunk) {
+    return NULL;
+  }
+  return __atomic_load_n(&chunk[slot & ARENA_CHUNK_MASK], __ATOMIC_ACQUIRE);
+}
+
+/* Puts an arena at an index, allocating the directory and chunk if necessary.
+ * The arena must be fully initialized, since readers can see it immediately.
+ */
+static inline void arena_table_set(arena_table *t, int index, arena_info *a) {
+  arena_chunk *dir;
+  arena_chunk chunk;
+  int thread, slot;
+
+  thread = index >> t->thread_shift;
+  slot = index & ((1 << t->thread_shift) - 1);
+
+  dir = t->threads[thread];
+  if(!dir) {
+    dir = (arena_chunk *) calloc(t->chunks_per_thread, sizeof(arena_chunk));
+    __atomic_store_n(&t->threads[thread], dir, __ATOMIC_RELEASE);
+  }
+  chunk = dir[slot >> ARENA_CHUNK_SHIFT];
+  if(!chunk) {
+    chunk = (arena_chunk) calloc(ARENA_CHUNK_SIZE, sizeof(arena_info *));
+    __atomic_store_n(&dir[slot >> ARENA_CHUNK_SHIFT], chunk, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&chunk[slot & ARENA_CHUNK_MASK], a, __ATOMIC_RELEASE);
+}
+
+/* Gets the first index at or after `index` that has an arena, or -1.
+ * Skips over directories and chunks that were never allocated.
+ */
+static inline int arena_table_next(arena_table *t, int index) {
+  arena_chunk *dir;
+  arena_chunk chunk;
+  int thread, slot, slots;
+
+  slots = 1 << t->thread_shift;
+  thread = index >> t->thread_shift;
+  slot = index & (slots - 1);
+  for(; thread < t->num_threads; thread++, slot = 0) {
+    dir = __atomic_load_n(&t->threads[thread], __ATOMIC_ACQUIRE);
+    if(!dir) continue;
+    while(slot < t->slots_per_thread) {
+      chunk = __atomic_load_n(&dir[slot >> ARENA_CHUNK_SHIFT], __ATOMIC_ACQUIRE);
+      if(!chunk) {
+        slot = ((slot >> ARENA_CHUNK_SHIFT) + 1) << ARENA_CHUNK_SHIFT;
+        continue;
+      }
+      if(__atomic_load_n(&chunk[slot & ARENA_CHUNK_MASK], __ATOMIC_ACQUIRE)) {
+        return (thread << t->thread_shift) | slot;
+      }
+      slot++;
+    }
+  }
+  return -1;
+}
+
+/* Frees the table itself. The arenas in it are the caller's. */
+static inline void arena_table_free(arena_table *t) {
+  int thread, chunk;
+
+  for(thread = 0; thread < t->num_threads; thread++) {
+    if(!t->threads[thread]) continue;
+    for(chunk = 0; chunk < t->chunks_per_thread; chunk++) {
+      free(t->threads[thread][chunk]);
+    }
+    free(t->threads[thread]);
+  }
+  free(t->threads);
+  t->threads = NULL;
+}
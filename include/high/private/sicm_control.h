@@ -0,0 +1,21 @@
+#pragma once
+/* The control socket. With SH_CONTROL_SOCKET set, a thread listens on a
+ * UNIX-domain stream socket at that path and answers line-based commands,
+ * so placements can be inspected and changed while the application runs.
+ * sicm_ctl is a small client for it.
+ *
+ * Commands, one per line:
+ *   list                    One line per arena: site, arena index, NUMA node,
+ *                           RSS, peak RSS, accesses and placement flags
+ *   move <site> <node>      Moves a site to a NUMA node; -1 is the default device
+ *   pin <site>              Stops online profiling and guidance from moving a site
+ *   unpin <site>
+ *   get                     Prints the online profiling tiers
+ *   set node <node> [tier]  Sets the NUMA node of an online profiling tier;
+ *                           the tier defaults to 0, the fastest
+ *   set cap <bytes> [tier]  Sets the capacity of an online profiling tier
+ * Every reply ends with a line that is either "ok" or starts with "error:".
+ */
+
+void sh_start_control_thread(char *path);
+void sh_stop_control_thread();
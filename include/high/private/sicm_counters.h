@@ -0,0 +1,37 @@
+#pragma once
+/* Per-site allocation counters, for SH_COUNT_ALLOCATIONS. Each thread counts
+ * into its own shard, indexed by its thread index, so counting never
+ * contends; the shards are only added up when the results are printed.
+ * A shard is split into cache-line-aligned chunks of sites, allocated the
+ * first time the thread touches one of their sites.
+ *
+ * Sizes are jemalloc's usable sizes, so that bytes allocated and freed
+ * match up. A free is attributed to the site that owns the pointer's arena,
+ * which is only known in the per-site layouts; elsewhere, and for the pooled
+ * arenas, frees are counted as unattributed. Frees and live bytes are only
+ * printed for the sites that have an arena of their own.
+ */
+#include <stdlib.h>
+
+#define COUNTERS_CHUNK_SHIFT 6
+#define COUNTERS_CHUNK_SIZE  (1 << COUNTERS_CHUNK_SHIFT)
+#define COUNTERS_NUM_SIZES   12 /* 16 bytes, 64 bytes, ..., 16MB, and larger */
+
+typedef struct site_counters {
+  size_t allocs, alloc_bytes, frees, free_bytes;
+  size_t sizes[COUNTERS_NUM_SIZES];
+} __attribute__((aligned(64))) site_counters;
+
+/* A pointer's site and size, looked up before it's freed */
+typedef struct counted_ptr {
+  int site;
+  size_t sz;
+} counted_ptr;
+
+void sh_counters_init(int max_threads, int max_sites);
+void sh_counters_set_arena_site(sicm_arena arena, int id);
+void sh_counters_alloc(int id, void *ptr);
+void sh_counters_lookup(void *ptr, counted_ptr *cp);
+void sh_counters_freed(counted_ptr *cp);
+void sh_counters_print();
+void sh_counters_terminate();
@@ -0,0 +1,35 @@
+#pragma once
+/* DAMON access monitoring, for SH_PROFILE_ALL_BACKEND=damon. The kernel
+ * watches the extents' address ranges itself, at a cost that doesn't grow
+ * with the access rate, and each interval we read back how often each of
+ * its regions was accessed and map that onto the sites whose extents it
+ * overlaps.
+ *
+ * Everything goes through DAMON's sysfs interface, which needs root and a
+ * kernel with CONFIG_DAMON_SYSFS and CONFIG_DAMON_VADDR. The extents are
+ * given to one kdamond as the fixed regions of this process ("fvaddr"), and
+ * a "stat" scheme that matches every region is what reports them.
+ *
+ * With SH_DAMON_MIGRATE, two more schemes let the kernel move pages as it
+ * finds them: "migrate_hot" pulls regions accessed in at least
+ * DAMON_HOT_ACCESSES samples of an aggregation interval onto the hot node,
+ * and "migrate_cold" pushes regions that haven't been accessed for
+ * DAMON_COLD_AGE aggregation intervals onto the cold node. The schemes
+ * cover every extent, so they're refused when online profiling or guidance
+ * places the sites instead.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+
+#define DAMON_HOT_ACCESSES 5
+#define DAMON_COLD_AGE     50
+
+typedef struct damon_region {
+  uint64_t start, end;
+  unsigned nr_accesses; /* Samples in the last aggregation interval that found it accessed */
+} damon_region;
+
+void sh_damon_init(int hot_node, int cold_node);
+void sh_damon_set_targets(extent_info *sorted_extents, size_t num_extents);
+size_t sh_damon_get_regions(damon_region **regions);
+void sh_damon_terminate();
@@ -0,0 +1,126 @@
+#pragma once
+/* The binary guidance format. sicm_hotset writes it, and the high-level
+ * runtime maps it straight into memory instead of parsing the text
+ * "===== GUIDANCE =====" section line by line.
+ *
+ * A guidance_header, followed by `num_sites` guidance_entry structs,
+ * all in the native byte order of the machine that wrote it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define GUIDANCE_MAGIC     "SICMGDNC"
+#define GUIDANCE_MAGIC_LEN 8
+#define GUIDANCE_VERSION   1
+
+typedef struct guidance_header {
+  char magic[GUIDANCE_MAGIC_LEN];
+  uint32_t version;
+  uint32_t num_sites;
+} guidance_header;
+
+typedef struct guidance_entry {
+  uint32_t site;
+  int16_t node;     /* NUMA node that the site goes onto */
+  uint16_t hotness; /* Hotness class, 0 is the coldest */
+} guidance_entry;
+
+/* A guidance file, either mapped in or read from text */
+typedef struct guidance_map {
+  void *addr;
+  size_t len;
+  guidance_entry *entries;
+  uint32_t num_sites;
+} guidance_map;
+
+/* Writes binary guidance. Returns 0 on success. */
+static inline int sh_write_guidance(FILE *file, guidance_entry *entries, uint32_t num_sites) {
+  guidance_header header;
+
+  memset(&header, 0, sizeof(guidance_header));
+  memcpy(header.magic, GUIDANCE_MAGIC, GUIDANCE_MAGIC_LEN);
+  header.version = GUIDANCE_VERSION;
+  header.num_sites = num_sites;
+
+  if(fwrite(&header, sizeof(guidance_header), 1, file) != 1) {
+    return -1;
+  }
+  if(num_sites && (fwrite(entries, sizeof(guidance_entry), num_sites, file) != num_sites)) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Whether a file starts with the binary guidance magic */
+static inline int sh_is_binary_guidance(const char *path) {
+  char magic[GUIDANCE_MAGIC_LEN];
+  FILE *file;
+  int ret;
+
+  file = fopen(path, "r");
+  if(!file) {
+    return 0;
+  }
+  ret = (fread(magic, GUIDANCE_MAGIC_LEN, 1, file) == 1) &&
+        (memcmp(magic, GUIDANCE_MAGIC, GUIDANCE_MAGIC_LEN) == 0);
+  fclose(file);
+  return ret;
+}
+
+/* Maps a binary guidance file into memory. Returns 0 on success. */
+static inline int sh_map_guidance(const char *path, guidance_map *map) {
+  guidance_header *header;
+  struct stat st;
+  int fd;
+
+  memset(map, 0, sizeof(guidance_map));
+
+  fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    fprintf(stderr, "Failed to open guidance file %s.\n", path);
+    return -1;
+  }
+  if((fstat(fd, &st) != 0) || (st.st_size < sizeof(guidance_header))) {
+    fprintf(stderr, "Guidance file %s is too small.\n", path);
+    close(fd);
+    return -1;
+  }
+  map->len = st.st_size;
+  map->addr = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map->addr == MAP_FAILED) {
+    fprintf(stderr, "Failed to map guidance file %s.\n", path);
+    map->addr = NULL;
+    return -1;
+  }
+
+  header = (guidance_header *) map->addr;
+  if((memcmp(header->magic, GUIDANCE_MAGIC, GUIDANCE_MAGIC_LEN) != 0) ||
+     (header->version != GUIDANCE_VERSION) ||
+     (map->len < sizeof(guidance_header) + ((size_t) header->num_sites * sizeof(guidance_entry)))) {
+    fprintf(stderr, "Guidance file %s is malformed or from another version.\n", path);
+    munmap(map->addr, map->len);
+    map->addr = NULL;
+    return -1;
+  }
+
+  map->entries = (guidance_entry *) (header + 1);
+  map->num_sites = header->num_sites;
+  return 0;
+}
+
+static inline void sh_unmap_guidance(guidance_map *map) {
+  if(map->addr) {
+    munmap(map->addr, map->len);
+  } else {
+    /* Read from text */
+    free(map->entries);
+  }
+  memset(map, 0, sizeof(guidance_map));
+}
@@ -17,21 +17,69 @@ enum arena_layout {
   INVALID_LAYOUT
 };
 
+/* Intervals that are compared against the current phase to detect a new one */
+#define PHASE_WINDOW 3
+
 /* Keeps track of additional information about arenas for profiling */
 typedef struct arena_info {
   unsigned index, id;
   sicm_arena arena;
   size_t accesses, rss, peak_rss;
+  size_t reads, writes; /* Sampled loads and stores, for SH_PROFILE_ALL_STORES */
+  size_t weight; /* Latency of the sampled loads that went to memory, in cycles */
+  /* Since the last SH_PROFILE_OUTPUT record */
+  size_t interval_accesses, interval_reads, interval_writes, interval_weight;
+  size_t *node_rss, *peak_node_rss; /* Per NUMA node, from SH_PROFILE_RSS */
+
+  /* For following phases. `rate` is the value that online profiling ranks
+   * by, decayed by SH_PROFILE_ALL_DECAY each interval. `recent` holds the
+   * last PHASE_WINDOW intervals, and `phase_value` everything since the
+   * current phase started.
+   */
+  double rate;
+  size_t prev_value, phase_value;
+  size_t recent[PHASE_WINDOW];
 } arena_info;
 
-/* A tree associating site IDs with device pointers.
- * Sites should be bound the device that they're associated with.
- * Filled with guidance from an offline profiling run or with
- * online profiling.
- */
+#include "sicm_arena_table.h"
+
 typedef sicm_device * deviceptr;
-use_tree(unsigned, deviceptr);
-use_tree(deviceptr, int);
+
+/* Where an allocation site's memory should go. There's one of these per
+ * site ID in a dense array, filled with guidance from an offline profiling
+ * run or with online profiling. Packed into a single word so that the
+ * online profiler can republish a site's placement with one atomic store
+ * while other threads are allocating from it.
+ */
+typedef union site_placement {
+  uint64_t raw;
+  struct {
+    uint32_t arena;  /* Arena slot of the site, if SITE_HAS_ARENA */
+    uint16_t device; /* Index into the device list, if SITE_PLACED */
+    uint16_t flags;
+  } obj;
+} site_placement;
+
+#define SITE_PLACED    0x1 /* Bound to `device`; otherwise the default device */
+#define SITE_HAS_ARENA 0x2 /* `arena` has been chosen */
+#define SITE_LARGE     0x4 /* Has allocated SH_SMALL_SITE_CUMULATIVE_BYTES bytes in total */
+#define SITE_PINNED    0x8 /* Placed by hand; online profiling and guidance leave it alone */
+
+/* Hotness class of a site, from guidance. 0 is the coldest.
+ * Used to group sites under SH_AGGREGATE_ARENAS.
+ */
+#define SITE_NUM_CLASSES 4
+#define SITE_CLASS_SHIFT 8
+#define SITE_CLASS_MASK  ((SITE_NUM_CLASSES - 1) << SITE_CLASS_SHIFT)
+#define SITE_CLASS(p)    (((p).obj.flags & SITE_CLASS_MASK) >> SITE_CLASS_SHIFT)
+
+/* Flags that stay when a site moves to another device */
+#define SITE_STICKY    (SITE_LARGE | SITE_PINNED | SITE_CLASS_MASK)
+
+/* The `id` of the arenas that are shared between sites: the per-device pools
+ * of small sites, and the groups of SH_AGGREGATE_ARENAS.
+ */
+#define POOL_SITE_ID 0
 
 /* So we can access these things from profile.c.
  * These variables are defined in src/high/high.c.
@@ -39,14 +87,22 @@ use_tree(deviceptr, int);
 extern extent_arr *extents;
 extern extent_arr *rss_extents;
 extern pthread_rwlock_t extents_lock;
-extern arena_info **arenas;
-extern tree(unsigned, deviceptr) site_nodes;
+extern size_t extents_version;
+extern arena_table arenas;
+extern site_placement *site_placements;
+extern int max_sites;
+extern int aggregate_arenas;
 extern int should_profile_all, should_profile_one, should_profile_rss, should_profile_online;
 extern float profile_all_rate, profile_rss_rate;
+extern int profile_rss_threads;
+extern int profile_all_latency, profile_all_stores;
+extern float profile_all_decay, phase_threshold;
 extern char *profile_one_event, *profile_all_event;
-extern sicm_device *online_device;
+extern char *profile_output_path;
+extern int num_online_tiers;
+extern sicm_device **online_tiers;
 extern sicm_device *default_device;
-extern ssize_t online_device_cap;
+extern ssize_t *online_tier_caps;
 extern int max_index;
 extern int max_sample_pages;
 extern int sample_freq;
@@ -55,6 +111,22 @@ extern char **imcs;
 
 #define DEFAULT_ARENA_LAYOUT INVALID_LAYOUT
 
+/* Where SH_PROFILE_ALL gets its accesses from */
+enum profile_backend {
+  PROFILE_BACKEND_PEBS,    /* Hardware samples of loads and stores, through perf */
+  PROFILE_BACKEND_PAGEMAP, /* Pages written each interval, from the page tables */
+  PROFILE_BACKEND_DAMON,   /* Region access frequencies, from the kernel's DAMON */
+  INVALID_PROFILE_BACKEND
+};
+extern enum profile_backend profile_all_backend;
+extern int damon_hot_node, damon_cold_node;
+
+/* Set at the top of each of the runtime's own threads. libsicm_preload
+ * sends their allocations straight to jemalloc, so that they never come
+ * back into sh_alloc while holding one of the runtime's locks.
+ */
+extern __thread int sh_internal_thread;
+
 __attribute__((constructor))
 void sh_init();
 
@@ -69,4 +141,19 @@ void* sh_realloc(int id, void *ptr, size_t sz);
 void sh_create_extent(void *begin, void *end);
 
 void sh_free(void* ptr);
+
+void* sh_alloc_aligned(int id, size_t sz, size_t align);
+void* sh_aligned_alloc(int id, size_t align, size_t sz);
+int sh_posix_memalign(int id, void **memptr, size_t align, size_t sz);
+void sh_free_sized(void *ptr, size_t sz);
+void sh_free_aligned(void *ptr, size_t align);
+void sh_free_sized_aligned(void *ptr, size_t sz, size_t align);
 int get_arena_index(int id);
+
+site_placement get_site_placement(int id);
+sicm_device *get_site_device(int id);
+void set_site_device(int id, sicm_device *device);
+void set_site_class(int id, int hotness);
+void set_site_pinned(int id, int pinned);
+void sh_move_site(int id, sicm_device *device);
+sicm_device *get_device_from_numa_node(int id);
@@ -0,0 +1,36 @@
+#pragma once
+/* Object lifetime profiling, for SH_PROFILE_LIFETIMES. One in every N
+ * allocations on each thread is sampled: its pointer, site and allocation
+ * time go into a side table, and when it's freed, its lifetime goes into
+ * its site's histogram. Sampled objects that are never freed count as live
+ * at exit.
+ *
+ * The side table is a fixed number of buckets, each a cache line of
+ * pointers, so that a free only has to look at one cache line to find out
+ * whether its pointer was sampled. Slots are claimed with a CAS, and a
+ * sample is dropped if its bucket is full.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+
+#define LIFETIME_BUCKET_SHIFT 15
+#define LIFETIME_BUCKET_SLOTS 8  /* One cache line of pointers */
+#define LIFETIME_NUM_BINS     9  /* Under 1us, 10us, ..., 10s, and longer */
+#define LIFETIME_MIN_SAMPLES  16 /* Before a site can be called short-lived */
+
+/* What a site's objects mostly are */
+enum lifetime_class {
+  LIFETIME_UNKNOWN = 0,
+  LIFETIME_SHORT,     /* Freed within SH_SHORT_LIFETIME microseconds */
+  LIFETIME_PHASE,     /* Freed, but after that */
+  LIFETIME_PERMANENT  /* Still live at exit */
+};
+
+void sh_lifetime_init(int max_sites, long sample_rate, long short_lifetime_us);
+void sh_lifetime_alloc(int id, void *ptr);
+int sh_lifetime_remove(void *ptr, uint32_t *site, uint64_t *birth);
+void sh_lifetime_move(void *ptr, uint32_t site, uint64_t birth);
+void sh_lifetime_free(void *ptr);
+int sh_site_is_short_lived(int id);
+void sh_lifetime_print();
+void sh_lifetime_terminate();
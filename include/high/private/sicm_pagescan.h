@@ -0,0 +1,22 @@
+#pragma once
+/* Software access tracking, for SH_PROFILE_ALL_BACKEND=pagemap. Instead of
+ * sampling with the PMU, which VMs, containers and non-Intel machines often
+ * don't have, each interval finds out which pages of each extent have been
+ * written to since the last one, and which are resident. A site's accesses
+ * are the pages that it wrote, so online profiling and sicm_hotset work on
+ * any Linux machine, ranking sites by write heat.
+ *
+ * The extents are registered with an asynchronous write-protecting
+ * userfaultfd, and one PAGEMAP_SCAN ioctl per extent returns its written and
+ * present pages while write-protecting them again. Kernels without
+ * PAGEMAP_SCAN (before 6.7) fall back to soft-dirty bits: the extents' pagemap
+ * entries are read, and /proc/self/clear_refs resets the bits. So do
+ * extents that the userfaultfd won't register, like file-backed ones.
+ *
+ * The extents are copied when they change, and scanned without holding
+ * `extents_lock`.
+ */
+
+void sh_pagescan_init();
+void sh_pagescan_interval();
+void sh_pagescan_terminate();
@@ -9,11 +9,16 @@
 #include <inttypes.h>
 #include <limits.h>
 #include "sicm_tree.h"
+#include "sicm_timeseries.h"
 
 /* For parsing information about sites */
 typedef struct site {
 	float bandwidth;
 	uintmax_t peak_rss, accesses;
+	uintmax_t reads, writes, weight; /* From SH_PROFILE_ALL_STORES and SH_PROFILE_ALL_LATENCY */
+	uintmax_t allocs, alloc_bytes; /* From SH_COUNT_ALLOCATIONS */
+	char short_lived; /* From SH_PROFILE_LIFETIMES */
+	uintmax_t num_intervals; /* Bandwidth records, from SH_PROFILE_OUTPUT */
 } site;
 typedef site * siteptr;
 use_tree(unsigned, siteptr);
@@ -33,8 +38,10 @@ static inline app_info *sh_parse_site_info(FILE *file) {
 	size_t total_time, tmp_time;
 	long long num_sites, node;
 	siteptr cur_site;
-	int mbi, pebs, pebs_site, i, hours, minutes;
+	int mbi, pebs, allocs, lifetimes, csv, pebs_site, i, hours, minutes, csv_node;
 	float bandwidth, seconds;
+	uintmax_t time_ms, csv_accesses, csv_rss, csv_reads, csv_writes, csv_weight;
+	unsigned csv_site, csv_phase;
 	tree_it(unsigned, siteptr) it;
 	app_info *info;
 
@@ -57,6 +64,9 @@ static inline app_info *sh_parse_site_info(FILE *file) {
 	num_sites = 0;
 	mbi = 0;
 	pebs = 0;
+	allocs = 0;
+	lifetimes = 0;
+	csv = 0;
 	pebs_site = 0;
 	line = NULL;
 	len = 0;
@@ -65,6 +75,55 @@ static inline app_info *sh_parse_site_info(FILE *file) {
 		tok = strtok(line, " \t");
 		if(!tok) break;
 
+		/* A time series from SH_PROFILE_OUTPUT, instead of the text results.
+		 * Files from before the phase, reads, writes and weight columns start
+		 * the same way.
+		 */
+		if(strncmp(tok, TIMESERIES_HEADER, strlen("time_ms,site,")) == 0) {
+			csv = 1;
+			continue;
+		}
+		if(csv) {
+			/* One record per site per interval. Accesses add up, RSS peaks,
+			 * and bandwidth is averaged over the intervals that measured it.
+			 */
+			i = sscanf(tok, "%ju,%u,%ju,%ju,%f,%d,%u,%ju,%ju,%ju", &time_ms, &csv_site,
+			           &csv_accesses, &csv_rss, &bandwidth, &csv_node, &csv_phase,
+			           &csv_reads, &csv_writes, &csv_weight);
+			if(i < 6) {
+				continue;
+			}
+			if(i < 10) {
+				csv_reads = 0;
+				csv_writes = 0;
+				csv_weight = 0;
+			}
+			it = tree_lookup(info->sites, csv_site);
+			if(tree_it_good(it)) {
+				cur_site = tree_it_val(it);
+			} else {
+				cur_site = calloc(1, sizeof(site));
+				tree_insert(info->sites, csv_site, cur_site);
+				if(bandwidth > 0) {
+					info->num_mbi_sites++;
+				} else {
+					info->num_pebs_sites++;
+				}
+			}
+			cur_site->accesses += csv_accesses;
+			cur_site->reads += csv_reads;
+			cur_site->writes += csv_writes;
+			cur_site->weight += csv_weight;
+			if(csv_rss > cur_site->peak_rss) {
+				cur_site->peak_rss = csv_rss;
+			}
+			if(bandwidth > 0) {
+				cur_site->num_intervals++;
+				cur_site->bandwidth += (bandwidth - cur_site->bandwidth) / cur_site->num_intervals;
+			}
+			continue;
+		}
+
 		/* Find the beginning or end of some results */
 		if(strcmp(tok, "=====") == 0) {
 			/* Get whether it's the end of results, or MBI, or PEBS */
@@ -98,15 +157,30 @@ static inline app_info *sh_parse_site_info(FILE *file) {
 					cur_site->bandwidth = 0;
 					cur_site->peak_rss = 0;
 					cur_site->accesses = 0;
+					cur_site->allocs = 0;
+					cur_site->alloc_bytes = 0;
+					cur_site->short_lived = 0;
+					cur_site->num_intervals = 0;
+					cur_site->reads = 0;
+					cur_site->writes = 0;
+					cur_site->weight = 0;
 					tree_insert(info->sites, mbi, cur_site);
 					info->num_mbi_sites++;
 				}
 			} else if(strcmp(tok, "PEBS") == 0) {
 				pebs = 1;
 				continue; /* Don't need the rest of this line */
+			} else if(strcmp(tok, "ALLOCATION") == 0) {
+				allocs = 1;
+				continue;
+			} else if(strcmp(tok, "LIFETIME") == 0) {
+				lifetimes = 1;
+				continue;
 			} else if(strcmp(tok, "END") == 0) {
 				mbi = 0;
 				pebs = 0;
+				allocs = 0;
+				lifetimes = 0;
 				continue;
 			} else {
 				fprintf(stderr, "Found '=====', but no descriptor. Aborting.\n");
@@ -138,6 +212,36 @@ static inline app_info *sh_parse_site_info(FILE *file) {
 				exit(1);
 			}
 			continue;
+		} else if(allocs || lifetimes) {
+			/* Allocation counts and lifetimes only fill in sites that were profiled */
+			if(tok && (strcmp(tok, "Site") == 0)) {
+				tok = strtok(NULL, " ");
+				cur_site = NULL;
+				if(tok) {
+					it = tree_lookup(info->sites, strtoimax(tok, NULL, 10));
+					if(tree_it_good(it)) {
+						cur_site = tree_it_val(it);
+					}
+				}
+			} else if(cur_site && tok && (strcmp(tok, "Allocations:") == 0)) {
+				tok = strtok(NULL, " ");
+				if(tok) {
+					cur_site->allocs = strtoumax(tok, NULL, 10);
+				}
+			} else if(cur_site && tok && (strcmp(tok, "Bytes") == 0)) {
+				tok = strtok(NULL, " ");
+				if(tok && (strcmp(tok, "allocated:") == 0)) {
+					tok = strtok(NULL, " ");
+					if(tok) {
+						cur_site->alloc_bytes = strtoumax(tok, NULL, 10);
+					}
+				}
+			} else if(cur_site && tok && (strcmp(tok, "Lifetime:") == 0)) {
+				tok = strtok(NULL, " \n");
+				cur_site->short_lived = tok && (strcmp(tok, "short") == 0);
+			}
+			/* The rest is for people to read */
+			continue;
 		} else if(pebs) {
 			/* We're in a block of PEBS results */
 			if(tok && (strcmp(tok, "Site") == 0)) {
@@ -154,6 +258,13 @@ static inline app_info *sh_parse_site_info(FILE *file) {
 						cur_site->bandwidth = 0;
 						cur_site->peak_rss = 0;
 						cur_site->accesses = 0;
+						cur_site->allocs = 0;
+						cur_site->alloc_bytes = 0;
+						cur_site->short_lived = 0;
+						cur_site->num_intervals = 0;
+						cur_site->reads = 0;
+						cur_site->writes = 0;
+						cur_site->weight = 0;
 						tree_insert(info->sites, pebs_site, cur_site);
 						info->num_pebs_sites++;
 					}
@@ -161,7 +272,8 @@ static inline app_info *sh_parse_site_info(FILE *file) {
 					fprintf(stderr, "Got 'Site' but no expected site number. Aborting.\n");
 					exit(1);
 				}
-			} else if(tok && (strcmp(tok, "Totals:") == 0)) {
+			} else if(tok && ((strcmp(tok, "Totals:") == 0) || (strcmp(tok, "Samples:") == 0) ||
+			                  (strcmp(tok, "Phases:") == 0))) {
 				/* Ignore the totals */
 				continue;
 			} else {
@@ -173,6 +285,21 @@ static inline app_info *sh_parse_site_info(FILE *file) {
 						exit(1);
 					}
 					cur_site->accesses = strtoimax(tok, NULL, 10);
+				} else if(tok && ((strcmp(tok, "Reads:") == 0) || (strcmp(tok, "Writes:") == 0) ||
+				                  (strcmp(tok, "Weight:") == 0))) {
+					ptr = tok;
+					tok = strtok(NULL, " ");
+					if(!tok) {
+						fprintf(stderr, "Got '%s' but no value. Aborting.\n", ptr);
+						exit(1);
+					}
+					if(strcmp(ptr, "Reads:") == 0) {
+						cur_site->reads = strtoumax(tok, NULL, 10);
+					} else if(strcmp(ptr, "Writes:") == 0) {
+						cur_site->writes = strtoumax(tok, NULL, 10);
+					} else {
+						cur_site->weight = strtoumax(tok, NULL, 10);
+					}
 				} else if(tok && (strcmp(tok, "Peak") == 0)) {
 					tok = strtok(NULL, " ");
 					if(tok && (strcmp(tok, "RSS:") == 0)) {
@@ -182,6 +309,9 @@ static inline app_info *sh_parse_site_info(FILE *file) {
 							exit(1);
 						}
 						cur_site->peak_rss = strtoumax(tok, NULL, 10);
+					} else if(tok && (strcmp(tok, "RSS") == 0)) {
+						/* "Peak RSS on node N:" is for people to read */
+						continue;
 					} else {
 						fprintf(stderr, "Got 'Peak' but not 'RSS:'. Aborting.\n");
 						exit(1);
@@ -18,20 +18,24 @@
 #include <pthread.h>
 #include <errno.h>
 #include <poll.h>
+#include <sys/epoll.h>
 
+/* Only the fields in `sample_type` are there, in this order */
 struct __attribute__ ((__packed__)) sample {
     uint64_t addr;
+    uint64_t weight;   /* With PERF_SAMPLE_WEIGHT */
+    uint64_t data_src; /* With PERF_SAMPLE_DATA_SRC */
 };
 
-union pfn_t {
-  uint64_t raw;
-  struct {
-    uint64_t pfn:     55;
-    uint32_t pshift:  6;
-    uint32_t res:     1;
-    uint32_t swapped: 1;
-    uint32_t present: 1;
-  } obj;
+/* A sample, copied out of a ring buffer to be attributed */
+typedef struct sampled_access {
+  uint64_t addr, weight;
+  char store;
+} sampled_access;
+
+/* The body of a PERF_RECORD_LOST */
+struct __attribute__ ((__packed__)) lost {
+    uint64_t id, lost;
 };
 
 typedef struct profile_thread {
@@ -44,19 +48,36 @@ typedef struct profile_thread {
   /* For perf */
   size_t size, total;
   struct perf_event_attr **pes; /* Array of pe structs, for multiple events */
-  struct perf_event_mmap_page *metadata;
   int *fds;
   uint64_t consumed;
-  struct pollfd pfd;
   char oops;
 
+  /* For PEBS, one event and ring buffer per CPU. The events are inherited,
+   * so they follow every thread that the process starts after sh_init.
+   */
+  struct perf_event_mmap_page **rings;
+  int epoll_fd, num_cpus;
+  size_t sample_size;
+
+  /* For attributing samples to arenas. Each interval's sample addresses are
+   * sorted and merge-joined against a sorted copy of the extents, which is
+   * only rebuilt when `extents_version` changes.
+   */
+  sampled_access *addrs;
+  size_t num_addrs, max_addrs;
+  extent_info *sorted_extents;
+  size_t num_sorted_extents, max_sorted_extents, sorted_version;
+  size_t damon_version; /* Of the extents that DAMON was last given */
+  size_t attributed, unattributed, lost;
+
+  /* For detecting phases */
+  unsigned phase;
+  size_t phase_intervals, phase_start; /* Intervals so far, and before this phase */
+
   /* For libpfm */
   pfm_perf_encode_arg_t *pfm;
 
-  /* For determining RSS */
-  int pagemap_fd;
-  union pfn_t *pfndata;
-  size_t pagesize, addrsize;
+  size_t pagesize;
 
   /* For measuring bandwidth */
   size_t num_intervals;
@@ -0,0 +1,29 @@
+#pragma once
+/* Per-arena RSS, for SH_PROFILE_RSS. Each pass reads the pagemap entries of
+ * the extents to find out how many of their pages are resident, and on which
+ * NUMA nodes.
+ *
+ * Reading every page of every extent each second doesn't scale to processes
+ * with hundreds of gigabytes, so a pass does a bounded amount of work:
+ *   - Extents that are new since the last pass are always scanned.
+ *   - The rest are rescanned round-robin, until the pass has looked at
+ *     RSS_PASS_PAGES pages. The others keep the RSS from their last scan.
+ *   - Extents larger than RSS_SAMPLE_PAGES only have that many of their pages
+ *     read, in evenly spaced runs of RSS_RUN_PAGES that move along each pass,
+ *     and their RSS is scaled up from them.
+ * The extents are scanned by SH_PROFILE_RSS_THREADS threads, without holding
+ * `extents_lock`. The first resident page of each run is passed to
+ * move_pages to find its node, and an extent's RSS is split among the nodes
+ * in the same proportions.
+ */
+#include "sicm_high.h"
+
+#define RSS_RUN_PAGES    512     /* Pagemap entries per read, 4KB of them */
+#define RSS_SAMPLE_PAGES 65536   /* Larger extents are sampled */
+#define RSS_NODE_SAMPLES (RSS_SAMPLE_PAGES / RSS_RUN_PAGES)
+#define RSS_PASS_PAGES   4194304 /* Pages looked at per pass, besides new extents */
+
+void sh_rss_init(int num_threads);
+void sh_rss_scan();
+void sh_rss_print_nodes(arena_info *arena);
+void sh_rss_terminate();
@@ -0,0 +1,47 @@
+#pragma once
+/* Time-series profiling output, for SH_PROFILE_OUTPUT. Each profiling
+ * interval writes one record per site to a CSV file while the application
+ * runs, instead of only printing totals at exit. Phases stay visible, and a
+ * run that crashes keeps everything up to its last flush.
+ *
+ * The profiling threads only copy their records into a buffer. A writer
+ * thread formats and writes them, and flushes the file at least every
+ * TIMESERIES_FLUSH_SECONDS, so a slow disk doesn't stretch the intervals.
+ *
+ * The file starts with TIMESERIES_HEADER. Its columns are:
+ *   time_ms   Milliseconds since profiling started
+ *   site      Allocation site ID, or 0 for a pooled arena
+ *   accesses  Sampled accesses in this interval
+ *   rss       Resident bytes at the end of this interval
+ *   bandwidth MB/s in this interval, for SH_PROFILE_ONE
+ *   node      NUMA node that the site is bound to, or -1
+ *   phase     Phase of the application, for SH_PROFILE_ALL. It goes up by
+ *             one at each phase boundary.
+ *   reads     Sampled loads in this interval, for SH_PROFILE_ALL_STORES
+ *   writes    Sampled stores in this interval, for SH_PROFILE_ALL_STORES,
+ *             or written pages for the pagemap backend
+ *   weight    Latency of this interval's sampled loads, for
+ *             SH_PROFILE_ALL_LATENCY
+ * sh_parse_site_info recognizes the header and reads the records directly.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+
+#define TIMESERIES_HEADER        "time_ms,site,accesses,rss,bandwidth,node,phase,reads,writes,weight"
+#define TIMESERIES_BUFFER_SIZE   4096 /* Records per buffer */
+#define TIMESERIES_FLUSH_SECONDS 1
+
+typedef struct timeseries_record {
+  uint64_t time_ms;
+  uint32_t site;
+  int32_t node;
+  uint32_t phase;
+  size_t accesses, rss;
+  size_t reads, writes, weight;
+  float bandwidth;
+} timeseries_record;
+
+void sh_timeseries_start(const char *path);
+uint64_t sh_timeseries_now();
+void sh_timeseries_record(timeseries_record *record);
+void sh_timeseries_stop();
@@ -280,12 +280,28 @@ void *sicm_arena_alloc(sicm_arena sa, size_t sz);
  */
 void *sicm_arena_alloc_aligned(sicm_arena sa, size_t sz, size_t align);
 
+/// Allocate zero-initialized memory region
+/**
+ * @param sa arena that should be used for the allocation. ARENA_DEFAULT is allowed.
+ * @param num number of elements
+ * @param sz size of each element
+ * @return pointer to the new allocation, or NULL if the operation failed
+ * or if num * sz overflows.
+ *
+ * Specifying ARENA_DEFAULT makes the function equivalent to calloc.
+ * Memory fresh from the operating system isn't zeroed again.
+ */
+void *sicm_arena_calloc(sicm_arena sa, size_t num, size_t sz);
+
 /// Resize a memory region in an arena
 /**
  * @param sa arena that should be used for the allocation. ARENA_DEFAULT is allowed.
  * @param ptr pointer to the memory to be resized
  * @param sz new size
  * @return pointer to the new allocation, or NULL if unable to reallocate
+ *
+ * If the memory is already in the arena, it's resized in place if possible.
+ * Otherwise it's copied into the arena.
  */
 void *sicm_arena_realloc(sicm_arena sa, void *ptr, size_t sz);
 
@@ -321,6 +337,8 @@ void sicm_free(void *ptr);
  * @param ptr pointer to the memory to be resized
  * @param sz new size
  * @return pointer to the new allocation, or NULL if unable to reallocate
+ *
+ * The memory stays in the arena that it was allocated from.
  */
 void *sicm_realloc(void *ptr, size_t sz);
 
@@ -110,6 +110,9 @@ struct compass : public ModulePass {
         allocFnMap["malloc"] = "sh_alloc";
         allocFnMap["calloc"] = "sh_calloc";
         allocFnMap["realloc"] = "sh_realloc";
+        allocFnMap["posix_memalign"] = "sh_posix_memalign";
+        allocFnMap["aligned_alloc"] = "sh_aligned_alloc";
+        allocFnMap["memalign"] = "sh_aligned_alloc";
         dallocFnMap["free"] = "sh_free";
 
 	/* C++ */
@@ -118,6 +121,16 @@ struct compass : public ModulePass {
         dallocFnMap["_ZdaPv"] = "sh_free";
         dallocFnMap["_ZdlPv"] = "sh_free";
 
+	/* C++14 sized and C++17 aligned new/delete */
+        allocFnMap["_ZnamSt11align_val_t"] = "sh_alloc_aligned";
+        allocFnMap["_ZnwmSt11align_val_t"] = "sh_alloc_aligned";
+        dallocFnMap["_ZdaPvm"] = "sh_free_sized";
+        dallocFnMap["_ZdlPvm"] = "sh_free_sized";
+        dallocFnMap["_ZdaPvSt11align_val_t"] = "sh_free_aligned";
+        dallocFnMap["_ZdlPvSt11align_val_t"] = "sh_free_aligned";
+        dallocFnMap["_ZdaPvmSt11align_val_t"] = "sh_free_sized_aligned";
+        dallocFnMap["_ZdlPvmSt11align_val_t"] = "sh_free_sized_aligned";
+
 	/* Fortran */
         allocFnMap["f90_alloc"] = "f90_sh_alloc";
         allocFnMap["f90_alloca"] = "f90_sh_alloca";
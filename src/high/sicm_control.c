@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "sicm_high.h"
+#include "sicm_low.h"
+#include "sicm_impl.h"
+#include "sicm_control.h"
+
+static char *control_path;
+static int control_fd = -1;
+static int stop_pipe[2]; /* Written to when the control thread should stop */
+static pthread_t control_id;
+
+#define CONTROL_LINE_MAX 4096
+
+/* Writes a site's flags as letters, so that `list` stays readable */
+static void print_flags(FILE *out, site_placement placement) {
+  fprintf(out, "%s%s%s%s",
+          (placement.obj.flags & SITE_PLACED) ? "P" : "-",
+          (placement.obj.flags & SITE_HAS_ARENA) ? "A" : "-",
+          (placement.obj.flags & SITE_LARGE) ? "L" : "-",
+          (placement.obj.flags & SITE_PINNED) ? "N" : "-");
+  fprintf(out, "%d", SITE_CLASS(placement));
+}
+
+static void control_list(FILE *out) {
+  sicm_device_list devs;
+  arena_info *arena;
+  int index;
+
+  fprintf(out, "site arena node rss peak_rss accesses flags\n");
+  arena_table_for(&arenas, index, arena) {
+    if(arena->id == POOL_SITE_ID) {
+      fprintf(out, "pool ");
+    } else {
+      fprintf(out, "%u ", arena->id);
+    }
+    devs = sicm_arena_get_devices(arena->arena);
+    fprintf(out, "%d %d %zu %zu %zu ", index,
+            (devs.count == 1) ? sicm_numa_id(devs.devices[0]) : -1,
+            arena->rss, arena->peak_rss, arena->accesses);
+    free(devs.devices);
+    if(arena->id == POOL_SITE_ID) {
+      fprintf(out, "-\n");
+    } else {
+      print_flags(out, get_site_placement(arena->id));
+      fprintf(out, "\n");
+    }
+  }
+}
+
+/* Parses a site ID. Returns -1 if it's not one. */
+static int parse_site(char *str) {
+  char *end;
+  long site;
+
+  if(!str) {
+    return -1;
+  }
+  site = strtol(str, &end, 10);
+  if((*end != '\0') || (site <= POOL_SITE_ID) || (site >= max_sites)) {
+    return -1;
+  }
+  return (int) site;
+}
+
+/* Parses a NUMA node into a device. -1 is the default device.
+ * Returns 0 on success.
+ */
+static int parse_node(char *str, sicm_device **device) {
+  char *end;
+  long node;
+
+  if(!str) {
+    return -1;
+  }
+  node = strtol(str, &end, 10);
+  if(*end != '\0') {
+    return -1;
+  }
+  if(node == -1) {
+    *device = NULL;
+    return 0;
+  }
+  *device = get_device_from_numa_node((int) node);
+  return *device ? 0 : -1;
+}
+
+/* Parses an online profiling tier, which defaults to the fastest.
+ * Returns -1 if it's not one.
+ */
+static int parse_tier(char *str) {
+  char *end;
+  long tier;
+
+  if(!str) {
+    return num_online_tiers ? 0 : -1;
+  }
+  tier = strtol(str, &end, 10);
+  if((*end != '\0') || (tier < 0) || (tier >= num_online_tiers)) {
+    return -1;
+  }
+  return (int) tier;
+}
+
+/* Runs one command, writing its reply to `out` */
+static void control_command(char *line, FILE *out) {
+  char *cmd, *arg1, *arg2, *arg3, *end, *save;
+  sicm_device *device;
+  long long bytes;
+  int site, tier;
+
+  cmd = strtok_r(line, " \t\r\n", &save);
+  arg1 = strtok_r(NULL, " \t\r\n", &save);
+  arg2 = strtok_r(NULL, " \t\r\n", &save);
+  arg3 = strtok_r(NULL, " \t\r\n", &save);
+  if(!cmd) {
+    return;
+  }
+
+  if(strcmp(cmd, "list") == 0) {
+    control_list(out);
+  } else if(strcmp(cmd, "move") == 0) {
+    site = parse_site(arg1);
+    if(site < 0) {
+      fprintf(out, "error: invalid site\n");
+      return;
+    }
+    if(parse_node(arg2, &device) != 0) {
+      fprintf(out, "error: invalid NUMA node\n");
+      return;
+    }
+    sh_move_site(site, device);
+  } else if((strcmp(cmd, "pin") == 0) || (strcmp(cmd, "unpin") == 0)) {
+    site = parse_site(arg1);
+    if(site < 0) {
+      fprintf(out, "error: invalid site\n");
+      return;
+    }
+    set_site_pinned(site, cmd[0] == 'p');
+  } else if(strcmp(cmd, "get") == 0) {
+    fprintf(out, "online %d\n", should_profile_online);
+    for(tier = 0; tier < num_online_tiers; tier++) {
+      fprintf(out, "tier %d node %d cap %zd\n", tier,
+              sicm_numa_id(online_tiers[tier]), online_tier_caps[tier]);
+    }
+  } else if((strcmp(cmd, "set") == 0) && arg1 && (strcmp(arg1, "node") == 0)) {
+    if((parse_node(arg2, &device) != 0) || !device) {
+      fprintf(out, "error: invalid NUMA node\n");
+      return;
+    }
+    if((tier = parse_tier(arg3)) < 0) {
+      fprintf(out, "error: invalid tier\n");
+      return;
+    }
+    __atomic_store_n(&online_tiers[tier], device, __ATOMIC_RELAXED);
+  } else if((strcmp(cmd, "set") == 0) && arg1 && (strcmp(arg1, "cap") == 0)) {
+    if(!arg2) {
+      fprintf(out, "error: invalid capacity\n");
+      return;
+    }
+    bytes = strtoll(arg2, &end, 10);
+    if((*end != '\0') || (bytes < 0)) {
+      fprintf(out, "error: invalid capacity\n");
+      return;
+    }
+    if((tier = parse_tier(arg3)) < 0) {
+      fprintf(out, "error: invalid tier\n");
+      return;
+    }
+    __atomic_store_n(&online_tier_caps[tier], (ssize_t) bytes, __ATOMIC_RELAXED);
+  } else {
+    fprintf(out, "error: unknown command\n");
+    return;
+  }
+  fprintf(out, "ok\n");
+}
+
+/* Waits until `fd` can be read. Returns 0 if it can, or -1 if the control
+ * thread should stop.
+ */
+static int wait_readable(int fd) {
+  struct pollfd fds[2];
+
+  fds[0].fd = fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = stop_pipe[0];
+  fds[1].events = POLLIN;
+  while(poll(fds, 2, -1) == -1) {
+    if(errno != EINTR) return -1;
+  }
+  return (fds[1].revents) ? -1 : 0;
+}
+
+/* Runs a client's commands until it hangs up. Commands are read straight
+ * from the socket, so that waiting for one can be interrupted, and replies
+ * go through a stream of their own. Returns -1 if the control thread
+ * should stop.
+ */
+static int serve_client(int fd) {
+  char buf[CONTROL_LINE_MAX], *start, *newline;
+  size_t used;
+  ssize_t num;
+  FILE *out;
+  int ret, out_fd;
+
+  out_fd = dup(fd);
+  out = (out_fd == -1) ? NULL : fdopen(out_fd, "w");
+  if(!out) {
+    if(out_fd != -1) close(out_fd);
+    return 0;
+  }
+
+  used = 0;
+  ret = 0;
+  while(1) {
+    if(wait_readable(fd) != 0) {
+      ret = -1;
+      break;
+    }
+    num = read(fd, buf + used, sizeof(buf) - 1 - used);
+    if(num == -1) {
+      if(errno == EINTR) continue;
+      break;
+    }
+    if(num == 0) break;
+    used += num;
+
+    /* Run every complete line */
+    start = buf;
+    while((newline = memchr(start, '\n', buf + used - start)) != NULL) {
+      *newline = '\0';
+      control_command(start, out);
+      start = newline + 1;
+    }
+    used -= start - buf;
+    memmove(buf, start, used);
+    if(used == sizeof(buf) - 1) {
+      fprintf(out, "error: line too long\n");
+      used = 0;
+    }
+    fflush(out);
+  }
+  fclose(out);
+  return ret;
+}
+
+/* Serves one client at a time until it's told to stop */
+static void *control_thread(void *a) {
+  int fd;
+
+  sh_internal_thread = 1;
+
+  while(wait_readable(control_fd) == 0) {
+    fd = accept(control_fd, NULL, NULL);
+    if(fd == -1) {
+      if((errno == EINTR) || (errno == ECONNABORTED)) continue;
+      break;
+    }
+    if(serve_client(fd) != 0) {
+      close(fd);
+      break;
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+void sh_start_control_thread(char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  mode_t old_mask;
+  int err;
+
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Control socket path %s is too long. Aborting.\n", path);
+    exit(1);
+  }
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(control_fd == -1) {
+    fprintf(stderr, "Failed to create the control socket: %s. Aborting.\n", strerror(errno));
+    exit(1);
+  }
+  /* A socket left behind by an earlier run would make bind() fail, but
+   * anything else at the path is left alone
+   */
+  if(lstat(path, &st) == 0) {
+    if(!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Control socket path %s exists and isn't a socket. Aborting.\n", path);
+      exit(1);
+    }
+    unlink(path);
+  }
+  /* Only this user can connect and move sites */
+  old_mask = umask(0177);
+  err = bind(control_fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un));
+  umask(old_mask);
+  if((err != 0) || (listen(control_fd, 4) != 0)) {
+    fprintf(stderr, "Failed to listen on control socket %s: %s. Aborting.\n", path, strerror(errno));
+    exit(1);
+  }
+  if(pipe(stop_pipe) != 0) {
+    fprintf(stderr, "Failed to create a pipe for the control thread: %s. Aborting.\n", strerror(errno));
+    exit(1);
+  }
+  control_path = path;
+  pthread_create(&control_id, NULL, &control_thread, NULL);
+}
+
+void sh_stop_control_thread() {
+  if(control_fd == -1) {
+    return;
+  }
+  /* Wakes the control thread up, even in the middle of a client */
+  if(write(stop_pipe[1], "", 1) != 1) {
+    fprintf(stderr, "Failed to stop the control thread. Aborting.\n");
+    exit(1);
+  }
+  pthread_join(control_id, NULL);
+  close(stop_pipe[0]);
+  close(stop_pipe[1]);
+  close(control_fd);
+  control_fd = -1;
+  unlink(control_path);
+}
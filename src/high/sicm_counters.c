@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jemalloc/jemalloc.h>
+
+#include "sicm_high.h"
+#include "sicm_impl.h"
+#include "sicm_counters.h"
+
+int get_thread_index();
+
+/* jemalloc can't address more arenas than this with MALLOCX_ARENA */
+#define COUNTERS_MAX_ARENAS (1 << 12)
+
+static int max_threads, num_sites, num_chunks;
+
+/* shards[thread][chunk] is that thread's counters for a chunk of sites.
+ * Only the thread that holds the index writes to its shard. Indices are
+ * reused once their thread exits, so the shard is looked up through
+ * get_thread_index() every time, rather than cached per thread.
+ */
+static site_counters ***shards;
+
+/* The site that owns each jemalloc arena, or 0 if none does */
+static int arena_sites[COUNTERS_MAX_ARENAS];
+
+/* Whether each site has an arena of its own, so that its frees are counted */
+static char *site_has_arena;
+
+/* The MIB of "arenas.lookup", which finds the arena of a pointer */
+static size_t lookup_mib[2], lookup_miblen;
+
+/* The counters for the allocations that aren't attributed to a site */
+#define UNATTRIBUTED num_sites
+
+void sh_counters_init(int _max_threads, int max_sites) {
+  max_threads = _max_threads;
+  num_sites = max_sites;
+  /* One more, for the unattributed counters */
+  num_chunks = ((num_sites + 1) + COUNTERS_CHUNK_SIZE - 1) >> COUNTERS_CHUNK_SHIFT;
+  shards = (site_counters ***) calloc(max_threads, sizeof(site_counters **));
+  site_has_arena = (char *) calloc(num_sites, sizeof(char));
+
+  lookup_miblen = 2;
+  if(je_mallctlnametomib("arenas.lookup", lookup_mib, &lookup_miblen) != 0) {
+    fprintf(stderr, "Failed to look up arenas.lookup. Aborting.\n");
+    exit(1);
+  }
+}
+
+/* Called when an arena is created for just one site */
+void sh_counters_set_arena_site(sicm_arena arena, int id) {
+  unsigned arena_ind;
+
+  arena_ind = ((sarena *) arena)->arena_ind;
+  if(arena_ind < COUNTERS_MAX_ARENAS) {
+    __atomic_store_n(&arena_sites[arena_ind], id, __ATOMIC_RELAXED);
+    if((id >= 0) && (id < num_sites)) {
+      __atomic_store_n(&site_has_arena[id], 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Gets this thread's counters for a site, allocating its chunk if need be */
+static inline site_counters *get_counters(int id) {
+  site_counters *chunk, **shard;
+  int thread;
+
+  thread = get_thread_index();
+  shard = shards[thread];
+  if(!shard) {
+    shard = (site_counters **) calloc(num_chunks, sizeof(site_counters *));
+    __atomic_store_n(&shards[thread], shard, __ATOMIC_RELEASE);
+  }
+
+  chunk = shard[id >> COUNTERS_CHUNK_SHIFT];
+  if(!chunk) {
+    chunk = (site_counters *) aligned_alloc(64, COUNTERS_CHUNK_SIZE * sizeof(site_counters));
+    memset(chunk, 0, COUNTERS_CHUNK_SIZE * sizeof(site_counters));
+    __atomic_store_n(&shard[id >> COUNTERS_CHUNK_SHIFT], chunk, __ATOMIC_RELEASE);
+  }
+  return &chunk[id & (COUNTERS_CHUNK_SIZE - 1)];
+}
+
+/* Only this thread writes its counters, so an increment doesn't need to be
+ * atomic; the store just has to be whole for the thread that adds them up.
+ */
+#define counter_add(c, val) __atomic_store_n(&(c), (c) + (val), __ATOMIC_RELAXED)
+
+/* 16 bytes and under is bucket 0, then each bucket is four times bigger */
+static inline int size_bucket(size_t sz) {
+  int bucket;
+
+  if(sz <= 16) {
+    return 0;
+  }
+  bucket = ((64 - __builtin_clzl(sz - 1)) - 3) >> 1;
+  if(bucket >= COUNTERS_NUM_SIZES) {
+    bucket = COUNTERS_NUM_SIZES - 1;
+  }
+  return bucket;
+}
+
+void sh_counters_alloc(int id, void *ptr) {
+  site_counters *c;
+  size_t sz;
+
+  if(!ptr) {
+    return;
+  }
+  if((id < 0) || (id >= num_sites)) {
+    id = UNATTRIBUTED;
+  }
+  sz = je_sallocx(ptr, 0);
+  c = get_counters(id);
+  counter_add(c->allocs, 1);
+  counter_add(c->alloc_bytes, sz);
+  counter_add(c->sizes[size_bucket(sz)], 1);
+}
+
+/* Finds out who a pointer belongs to, while it's still allocated */
+void sh_counters_lookup(void *ptr, counted_ptr *cp) {
+  unsigned arena_ind;
+  size_t len;
+
+  cp->site = -1;
+  cp->sz = 0;
+  if(!ptr) {
+    return;
+  }
+  cp->sz = je_sallocx(ptr, 0);
+  len = sizeof(unsigned);
+  cp->site = UNATTRIBUTED;
+  if((je_mallctlbymib(lookup_mib, lookup_miblen, &arena_ind, &len, &ptr, sizeof(void *)) == 0) &&
+     (arena_ind < COUNTERS_MAX_ARENAS) &&
+     __atomic_load_n(&arena_sites[arena_ind], __ATOMIC_RELAXED)) {
+    cp->site = arena_sites[arena_ind];
+  }
+}
+
+void sh_counters_freed(counted_ptr *cp) {
+  site_counters *c;
+
+  if(cp->site < 0) {
+    return;
+  }
+  c = get_counters(cp->site);
+  counter_add(c->frees, 1);
+  counter_add(c->free_bytes, cp->sz);
+}
+
+/* Adds up every thread's counters for a site */
+static void sum_counters(int id, site_counters *sum) {
+  site_counters **s, *chunk, *c;
+  int thread, i;
+
+  memset(sum, 0, sizeof(site_counters));
+  for(thread = 0; thread < max_threads; thread++) {
+    s = __atomic_load_n(&shards[thread], __ATOMIC_ACQUIRE);
+    if(!s) continue;
+    chunk = __atomic_load_n(&s[id >> COUNTERS_CHUNK_SHIFT], __ATOMIC_ACQUIRE);
+    if(!chunk) continue;
+    c = &chunk[id & (COUNTERS_CHUNK_SIZE - 1)];
+    sum->allocs += __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+    sum->alloc_bytes += __atomic_load_n(&c->alloc_bytes, __ATOMIC_RELAXED);
+    sum->frees += __atomic_load_n(&c->frees, __ATOMIC_RELAXED);
+    sum->free_bytes += __atomic_load_n(&c->free_bytes, __ATOMIC_RELAXED);
+    for(i = 0; i < COUNTERS_NUM_SIZES; i++) {
+      sum->sizes[i] += __atomic_load_n(&c->sizes[i], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void sh_counters_print() {
+  site_counters sum;
+  size_t bucket_sz;
+  int id, i;
+
+  printf("===== ALLOCATION RESULTS =====\n");
+  for(id = 0; id < num_sites; id++) {
+    sum_counters(id, &sum);
+    if(!sum.allocs && !sum.frees) continue;
+    printf("Site %d:\n", id);
+    printf("  Allocations: %zu\n", sum.allocs);
+    printf("  Bytes allocated: %zu\n", sum.alloc_bytes);
+    /* Without an arena of its own, a site's frees are unattributed, and
+     * its live bytes would only ever grow
+     */
+    if(__atomic_load_n(&site_has_arena[id], __ATOMIC_RELAXED)) {
+      printf("  Frees: %zu\n", sum.frees);
+      printf("  Bytes freed: %zu\n", sum.free_bytes);
+      printf("  Live bytes: %zd\n", (ssize_t) (sum.alloc_bytes - sum.free_bytes));
+    }
+    printf("  Sizes:");
+    for(i = 0, bucket_sz = 16; i < COUNTERS_NUM_SIZES; i++, bucket_sz <<= 2) {
+      if(!sum.sizes[i]) continue;
+      if(i == COUNTERS_NUM_SIZES - 1) {
+        printf(" >%zu:%zu", bucket_sz >> 2, sum.sizes[i]);
+      } else {
+        printf(" %zu:%zu", bucket_sz, sum.sizes[i]);
+      }
+    }
+    printf("\n");
+  }
+  sum_counters(UNATTRIBUTED, &sum);
+  printf("Unattributed: %zu allocations, %zu bytes, %zu frees, %zu bytes\n",
+         sum.allocs, sum.alloc_bytes, sum.frees, sum.free_bytes);
+  printf("===== END ALLOCATION RESULTS =====\n");
+}
+
+void sh_counters_terminate() {
+  int thread, chunk;
+
+  for(thread = 0; thread < max_threads; thread++) {
+    if(!shards[thread]) continue;
+    for(chunk = 0; chunk < num_chunks; chunk++) {
+      free(shards[thread][chunk]);
+    }
+    free(shards[thread]);
+  }
+  free(shards);
+  free(site_has_arena);
+  shards = NULL;
+}
@@ -0,0 +1,64 @@
+/* sicm_ctl: sends a command to an application's SH_CONTROL_SOCKET and prints
+ * the reply. See sicm_control.h for the commands.
+ *   sicm_ctl <socket> <command> [args...]
+ * Exits with 1 if the command failed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int main(int argc, char **argv) {
+  struct sockaddr_un addr;
+  char *line;
+  size_t len;
+  FILE *server;
+  int fd, i, failed;
+
+  if(argc < 3) {
+    fprintf(stderr, "USAGE: ./sicm_ctl socket command [args...]\n");
+    fprintf(stderr, "Commands: list, move site node, pin site, unpin site, get, set node node [tier], set cap bytes [tier]\n");
+    exit(1);
+  }
+  if(strlen(argv[1]) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long.\n", argv[1]);
+    exit(1);
+  }
+
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, argv[1]);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if((fd == -1) || (connect(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) != 0)) {
+    fprintf(stderr, "Failed to connect to %s: %s\n", argv[1], strerror(errno));
+    exit(1);
+  }
+  server = fdopen(fd, "r+");
+  if(!server) {
+    fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+    exit(1);
+  }
+
+  for(i = 2; i < argc; i++) {
+    fprintf(server, "%s%c", argv[i], (i == argc - 1) ? '\n' : ' ');
+  }
+  fflush(server);
+  /* The server replies until it sees the end of our commands */
+  shutdown(fd, SHUT_WR);
+
+  line = NULL;
+  len = 0;
+  failed = 0;
+  while(getline(&line, &len, server) != -1) {
+    fputs(line, stdout);
+    if(strncmp(line, "error:", 6) == 0) {
+      failed = 1;
+    }
+  }
+  free(line);
+  fclose(server);
+  return failed;
+}
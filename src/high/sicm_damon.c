@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "sicm_high.h"
+#include "sicm_damon.h"
+
+#define DAMON_DIR     "/sys/kernel/mm/damon/admin/kdamonds"
+#define DAMON_CONTEXT "0/contexts/0"
+#define DAMON_MAX_U32 "4294967295"
+#define DAMON_MAX_U64 "18446744073709551615"
+
+static damon_region *regions;
+static size_t max_regions;
+
+/* Writes `value` to a file under the kdamonds directory. Returns 0 on success. */
+static int damon_write(const char *value, const char *fmt, ...) {
+  char path[512];
+  va_list args;
+  ssize_t len;
+  int fd;
+
+  len = snprintf(path, sizeof(path), "%s/", DAMON_DIR);
+  va_start(args, fmt);
+  vsnprintf(path + len, sizeof(path) - len, fmt, args);
+  va_end(args);
+
+  fd = open(path, O_WRONLY);
+  if(fd == -1) {
+    return -1;
+  }
+  len = write(fd, value, strlen(value));
+  close(fd);
+  return (len == strlen(value)) ? 0 : -1;
+}
+
+/* Like damon_write, but aborts if it fails */
+#define damon_must_write(value, ...) \
+  if(damon_write((value), __VA_ARGS__) != 0) { \
+    fprintf(stderr, "Failed to write '%s' to DAMON's ", (value)); \
+    fprintf(stderr, __VA_ARGS__); \
+    fprintf(stderr, ": %s. Aborting.\n", strerror(errno)); \
+    exit(1); \
+  }
+
+/* Reads a number from a file under the kdamonds directory. Returns 0 on success. */
+static int damon_read(uint64_t *value, const char *fmt, ...) {
+  char path[512], buf[32];
+  va_list args;
+  ssize_t len;
+  int fd;
+
+  len = snprintf(path, sizeof(path), "%s/", DAMON_DIR);
+  va_start(args, fmt);
+  vsnprintf(path + len, sizeof(path) - len, fmt, args);
+  va_end(args);
+
+  fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    return -1;
+  }
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(len <= 0) {
+    return -1;
+  }
+  buf[len] = '\0';
+  *value = strtoull(buf, NULL, 10);
+  return 0;
+}
+
+/* Sets up scheme `index` to match regions of any size with the given access
+ * counts and ages, and to do `action` to them
+ */
+static void set_scheme(int index, const char *action, const char *min_accesses, const char *max_accesses,
+                       const char *min_age, const char *max_age) {
+  damon_must_write(action, DAMON_CONTEXT "/schemes/%d/action", index);
+  damon_must_write("0", DAMON_CONTEXT "/schemes/%d/access_pattern/sz/min", index);
+  damon_must_write(DAMON_MAX_U64, DAMON_CONTEXT "/schemes/%d/access_pattern/sz/max", index);
+  damon_must_write(min_accesses, DAMON_CONTEXT "/schemes/%d/access_pattern/nr_accesses/min", index);
+  damon_must_write(max_accesses, DAMON_CONTEXT "/schemes/%d/access_pattern/nr_accesses/max", index);
+  damon_must_write(min_age, DAMON_CONTEXT "/schemes/%d/access_pattern/age/min", index);
+  damon_must_write(max_age, DAMON_CONTEXT "/schemes/%d/access_pattern/age/max", index);
+}
+
+static int region_cmp(const void *a, const void *b) {
+  uint64_t x = ((const damon_region *) a)->start, y = ((const damon_region *) b)->start;
+
+  return (x > y) - (x < y);
+}
+
+/* Sets up one kdamond to monitor this process, with a "stat" scheme to read
+ * the regions back through, and optionally the migration schemes. Either
+ * node can be -1, for no scheme.
+ */
+void sh_damon_init(int hot_node, int cold_node) {
+  char buf[32];
+  int num_schemes, scheme;
+
+  regions = NULL;
+  max_regions = 0;
+
+  /* This recreates the kdamonds, so it fails if any of them are running */
+  if(damon_write("1", "nr_kdamonds") != 0) {
+    fprintf(stderr, "Failed to set up a kdamond: %s. DAMON needs root, and can't already be in use. Aborting.\n",
+            strerror(errno));
+    exit(1);
+  }
+  damon_must_write("1", "0/contexts/nr_contexts");
+  damon_must_write("fvaddr", DAMON_CONTEXT "/operations");
+  damon_must_write("1", DAMON_CONTEXT "/targets/nr_targets");
+  snprintf(buf, sizeof(buf), "%d", (int) getpid());
+  damon_must_write(buf, DAMON_CONTEXT "/targets/0/pid_target");
+
+  num_schemes = 1 + (hot_node >= 0) + (cold_node >= 0);
+  snprintf(buf, sizeof(buf), "%d", num_schemes);
+  damon_must_write(buf, DAMON_CONTEXT "/schemes/nr_schemes");
+  set_scheme(0, "stat", "0", DAMON_MAX_U32, "0", DAMON_MAX_U32);
+  scheme = 1;
+  if(hot_node >= 0) {
+    snprintf(buf, sizeof(buf), "%d", DAMON_HOT_ACCESSES);
+    set_scheme(scheme, "migrate_hot", buf, DAMON_MAX_U32, "0", DAMON_MAX_U32);
+    snprintf(buf, sizeof(buf), "%d", hot_node);
+    damon_must_write(buf, DAMON_CONTEXT "/schemes/%d/target_nid", scheme);
+    printf("DAMON is moving hot regions to NUMA node %d.\n", hot_node);
+    scheme++;
+  }
+  if(cold_node >= 0) {
+    snprintf(buf, sizeof(buf), "%d", DAMON_COLD_AGE);
+    set_scheme(scheme, "migrate_cold", "0", "0", buf, DAMON_MAX_U32);
+    snprintf(buf, sizeof(buf), "%d", cold_node);
+    damon_must_write(buf, DAMON_CONTEXT "/schemes/%d/target_nid", scheme);
+    printf("DAMON is moving cold regions to NUMA node %d.\n", cold_node);
+    scheme++;
+  }
+
+  /* Nothing to monitor yet, so start once there are extents */
+}
+
+/* Gives DAMON the current extents, sorted and not overlapping, as the
+ * regions to monitor. Starts the kdamond the first time, and commits the
+ * new regions to it after that.
+ */
+void sh_damon_set_targets(extent_info *sorted_extents, size_t num_extents) {
+  static int running = 0;
+  char buf[32];
+  size_t i;
+
+  if(!num_extents) {
+    return;
+  }
+
+  snprintf(buf, sizeof(buf), "%zu", num_extents);
+  damon_must_write(buf, DAMON_CONTEXT "/targets/0/regions/nr_regions");
+  for(i = 0; i < num_extents; i++) {
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long) sorted_extents[i].start);
+    damon_must_write(buf, DAMON_CONTEXT "/targets/0/regions/%zu/start", i);
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long) sorted_extents[i].end);
+    damon_must_write(buf, DAMON_CONTEXT "/targets/0/regions/%zu/end", i);
+  }
+  /* DAMON splits and merges regions as it goes, but keep it from merging
+   * every extent into a handful of them
+   */
+  snprintf(buf, sizeof(buf), "%zu", (num_extents > 1000) ? num_extents : 1000);
+  damon_must_write(buf, DAMON_CONTEXT "/monitoring_attrs/nr_regions/max");
+
+  if(running) {
+    damon_must_write("commit", "0/state");
+  } else if(damon_write("on", "0/state") != 0) {
+    /* The operations are only checked now */
+    fprintf(stderr, "Failed to start DAMON: %s. Monitoring a process needs CONFIG_DAMON_VADDR. Aborting.\n",
+            strerror(errno));
+    damon_write("0", "nr_kdamonds");
+    exit(1);
+  }
+  running = 1;
+}
+
+/* Reads back DAMON's regions and how often each was accessed, sorted by
+ * start address. Returns the number of regions.
+ */
+size_t sh_damon_get_regions(damon_region **out) {
+  char path[512];
+  struct dirent *entry;
+  uint64_t val;
+  size_t num;
+  DIR *dir;
+  char *end;
+  long index;
+
+  num = 0;
+  *out = regions;
+  if(damon_write("update_schemes_tried_regions", "0/state") != 0) {
+    /* Not running yet */
+    return 0;
+  }
+
+  snprintf(path, sizeof(path), "%s/" DAMON_CONTEXT "/schemes/0/tried_regions", DAMON_DIR);
+  dir = opendir(path);
+  if(!dir) {
+    return 0;
+  }
+  while((entry = readdir(dir)) != NULL) {
+    index = strtol(entry->d_name, &end, 10);
+    if((end == entry->d_name) || (*end != '\0')) continue; /* Not a region */
+    if(num == max_regions) {
+      max_regions = max_regions ? max_regions * 2 : 1024;
+      regions = realloc(regions, max_regions * sizeof(damon_region));
+    }
+    if(damon_read(&regions[num].start, DAMON_CONTEXT "/schemes/0/tried_regions/%ld/start", index) ||
+       damon_read(&regions[num].end, DAMON_CONTEXT "/schemes/0/tried_regions/%ld/end", index) ||
+       damon_read(&val, DAMON_CONTEXT "/schemes/0/tried_regions/%ld/nr_accesses", index)) {
+      continue;
+    }
+    regions[num].nr_accesses = (unsigned) val;
+    num++;
+  }
+  closedir(dir);
+
+  qsort(regions, num, sizeof(damon_region), &region_cmp);
+  *out = regions;
+  return num;
+}
+
+void sh_damon_terminate() {
+  damon_write("off", "0/state");
+  damon_write("0", "nr_kdamonds");
+  free(regions);
+}
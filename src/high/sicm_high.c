@@ -8,31 +8,88 @@
 #include <string.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 #include <jemalloc/jemalloc.h>
 
 #include "sicm_high.h"
+#include "sicm_guidance.h"
 #include "sicm_low.h"
 #include "sicm_impl.h"
 #include "sicm_profile.h"
 #include "sicm_rdspy.h"
+#include "sicm_control.h"
+#include "sicm_counters.h"
+#include "sicm_lifetime.h"
 
 static struct sicm_device_list device_list;
 int num_numa_nodes;
 struct sicm_device *default_device;
 
-tree(unsigned, deviceptr) site_nodes;
-tree(deviceptr, int) device_arenas; /* For per-device arena layouts only */
+/* Per-site placement, indexed by site ID */
+site_placement *site_placements;
+int max_sites;
+
+/* For per-device arena layouts only: the arena slot of each device plus one,
+ * indexed like `device_list`. Zero until the device's first allocation.
+ */
+static int *device_arenas, num_device_arenas;
+
+/* For the per-site layouts only: sites that have allocated fewer than
+ * `small_site_threshold` bytes in total share a pooled arena per device, which
+ * starts at slot `pool_base`. `site_bytes` adds up each site's allocations
+ * until then. Frees aren't subtracted, since the pooled arenas can't tell
+ * which site an object came from, so a site that churns through small
+ * objects is promoted eventually, however little it has live.
+ */
+static size_t small_site_threshold, *site_bytes;
+static int pool_base;
+
+/* For SHARED_SITE_ARENAS only: if nonzero, sites share this many arenas.
+ * Sites are grouped by device and by `aggregate_classes` hotness classes,
+ * and each group is spread over `arenas_per_group` arenas.
+ */
+int aggregate_arenas;
+static int aggregate_classes, arenas_per_group;
+static int default_device_index;
+
+/* The guidance file, and which sites are in it. With SH_GUIDANCE_RELOAD,
+ * a thread rereads it when it changes, or on SIGHUP if the application
+ * hasn't installed a SIGHUP handler of its own.
+ */
+static char *guidance_path;
+static unsigned char *guided_sites;
+static int guidance_reload_interval;
+static volatile sig_atomic_t guidance_reload_requested;
+static pthread_t guidance_reload_id;
+
+/* With SH_CONTROL_SOCKET, the path of the control socket */
+static char *control_socket_path;
 
 /* For profiling */
 int should_profile_online;
 int should_profile_all; /* For sampling */
 float profile_all_rate;
+enum profile_backend profile_all_backend;
+int damon_hot_node, damon_cold_node; /* For SH_DAMON_MIGRATE, or -1 */
+int profile_all_latency; /* Minimum cycles of a latency-weighted load sample, or 0 */
+int profile_all_stores;
+float profile_all_decay; /* Weight of the latest interval in a site's rate */
+float phase_threshold;   /* Distance between profiles that starts a new phase, or 0 */
 int should_profile_one; /* For bandwidth profiling */
 int should_profile_rss;
 float profile_rss_rate;
+int profile_rss_threads;
+char *profile_output_path; /* For SH_PROFILE_OUTPUT */
 struct sicm_device *profile_one_device;
-struct sicm_device *online_device;
-ssize_t online_device_cap, online_device_packed_size;
+/* For SH_ONLINE_PROFILING: the tiers that online profiling packs onto,
+ * fastest first, and each one's capacity in bytes. Whatever doesn't fit goes
+ * to the default device.
+ */
+int num_online_tiers;
+struct sicm_device **online_tiers;
+ssize_t *online_tier_caps;
+ssize_t online_device_packed_size;
 char *profile_one_event;
 char *profile_all_event;
 int max_sample_pages;
@@ -46,21 +103,64 @@ int should_run_rdspy;
 extent_arr *extents;
 extent_arr *rss_extents; /* The extents that we want to get the RSS of */
 pthread_rwlock_t extents_lock = PTHREAD_RWLOCK_INITIALIZER;
+size_t extents_version; /* Bumped whenever `extents` changes */
 
 /* Keeps track of arenas */
-arena_info **arenas;
+arena_table arenas;
 static enum arena_layout layout;
-static int max_arenas, arenas_per_thread;
+static int max_arenas, arenas_per_thread, num_arenas;
 int max_index;
 pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Associates a thread with an index (starting at 0) into the `arenas` array */
+/* Associates a thread with an index (starting at 0) into the `arenas` array.
+ * When a thread exits, its index goes onto `free_thread_indices`, and the
+ * next new thread takes it over along with its arenas.
+ */
 static pthread_key_t thread_key;
-static int *thread_indices, *orig_thread_indices, *max_thread_indices, max_threads;
+static int *thread_indices, num_thread_indices, max_threads;
+static int *free_thread_indices, num_free_thread_indices;
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
 static int num_static_sites;
 
-/* Passes an arena index to the extent hooks */
-static int *pending_indices;
+/* Passes an arena index to the extent hooks. Thread-local, so that
+ * layouts that don't need a thread index never have to look one up.
+ * -1 means no sh_alloc is in progress on this thread.
+ */
+static __thread int pending_index = -1;
+
+__thread int sh_internal_thread = 0;
+
+/* The arena that this thread is creating. Creating it allocates its first
+ * extent, before the arena is published in `arenas`.
+ */
+static __thread arena_info *creating_arena = NULL;
+
+/* The allocation entry points, chosen in sh_init based on the arena layout
+ * and whether rdspy is enabled. Until then, everything goes to jemalloc.
+ */
+typedef struct sh_dispatch {
+  void *(*alloc)(int id, size_t sz);
+  void *(*calloc)(int id, size_t num, size_t sz);
+  void *(*realloc)(int id, void *ptr, size_t sz);
+  void *(*alloc_aligned)(int id, size_t sz, size_t align);
+  void (*free)(void *ptr);
+  void (*free_sized)(void *ptr, size_t sz, size_t align);
+} sh_dispatch;
+static void *sh_alloc_default(int id, size_t sz);
+static void *sh_calloc_default(int id, size_t num, size_t sz);
+static void *sh_realloc_default(int id, void *ptr, size_t sz);
+static void *sh_alloc_aligned_default(int id, size_t sz, size_t align);
+static void sh_free_sized_default(void *ptr, size_t sz, size_t align);
+static sh_dispatch dispatch = { sh_alloc_default, sh_calloc_default, sh_realloc_default,
+                                sh_alloc_aligned_default, je_free, sh_free_sized_default };
+/* What the rdspy entry points call into */
+static sh_dispatch rdspy_dispatch;
+/* What the counting entry points call into, for SH_COUNT_ALLOCATIONS */
+static sh_dispatch count_dispatch;
+static int should_count_allocations;
+/* What the lifetime-sampling entry points call into, for SH_PROFILE_LIFETIMES */
+static sh_dispatch lifetime_dispatch;
+static long lifetime_sample_rate, short_lifetime_us;
 
 /* Takes a string as input and outputs which arena layout it is */
 enum arena_layout parse_layout(char *env) {
@@ -122,8 +222,8 @@ sicm_device *get_device_from_numa_node(int id) {
 
   retval = NULL;
   /* Figure out which device the NUMA node corresponds to */
-  device = device_list.devices;
   for(i = 0; i < device_list.count; i++) {
+    device = device_list.devices[i];
     /* If the device has a NUMA node, and if that node is the node we're
      * looking for.
      */
@@ -134,7 +234,6 @@ sicm_device *get_device_from_numa_node(int id) {
       retval = device;
       break;
     }
-    device++;
   }
   /* If we don't find an appropriate device, it stays NULL
    * so that no allocation sites will be bound to it
@@ -146,27 +245,444 @@ sicm_device *get_device_from_numa_node(int id) {
   return retval;
 }
 
+/* Gets the index of a device in `device_list`, or -1 */
+static int get_device_index(sicm_device *device) {
+  int i;
+
+  for(i = 0; i < device_list.count; i++) {
+    if(device_list.devices[i] == device) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Reads a site's placement. Sites outside of the table aren't placed. */
+site_placement get_site_placement(int id) {
+  site_placement placement;
+
+  placement.raw = 0;
+  if((id >= 0) && (id < max_sites)) {
+    placement.raw = __atomic_load_n(&site_placements[id].raw, __ATOMIC_ACQUIRE);
+  }
+
+  return placement;
+}
+
+/* Binds a site to a device, or back to the default device if `device` is NULL.
+ * The site's arena slot is forgotten, so that the per-device layouts
+ * pick the slot of the new device on the next allocation.
+ */
+void set_site_device(int id, sicm_device *device) {
+  site_placement placement, old;
+  int index;
+
+  if((id < 0) || (id >= max_sites)) {
+    return;
+  }
+
+  placement.raw = 0;
+  if(device && (device != default_device)) {
+    index = get_device_index(device);
+    if(index < 0) {
+      return;
+    }
+    placement.obj.device = (uint16_t) index;
+    placement.obj.flags = SITE_PLACED;
+  }
+
+  /* Keep SITE_LARGE, which an allocating thread might be setting, and the rest
+   * of the flags that aren't about the device
+   */
+  old.raw = __atomic_load_n(&site_placements[id].raw, __ATOMIC_RELAXED);
+  do {
+    placement.obj.flags &= ~SITE_STICKY;
+    placement.obj.flags |= old.obj.flags & SITE_STICKY;
+  } while(!__atomic_compare_exchange_n(&site_placements[id].raw, &old.raw, placement.raw,
+                                       0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Sets the hotness class of a site, leaving the rest of its placement alone */
+void set_site_class(int id, int hotness) {
+  site_placement placement, old;
+
+  if((id < 0) || (id >= max_sites)) {
+    return;
+  }
+  if(hotness < 0) {
+    hotness = 0;
+  } else if(hotness >= SITE_NUM_CLASSES) {
+    hotness = SITE_NUM_CLASSES - 1;
+  }
+
+  old.raw = __atomic_load_n(&site_placements[id].raw, __ATOMIC_RELAXED);
+  do {
+    placement = old;
+    placement.obj.flags &= ~SITE_CLASS_MASK;
+    placement.obj.flags |= hotness << SITE_CLASS_SHIFT;
+  } while(!__atomic_compare_exchange_n(&site_placements[id].raw, &old.raw, placement.raw,
+                                       0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Pins or unpins a site. Online profiling and guidance reloads leave pinned sites alone. */
+void set_site_pinned(int id, int pinned) {
+  site_placement placement, old;
+
+  if((id < 0) || (id >= max_sites)) {
+    return;
+  }
+
+  old.raw = __atomic_load_n(&site_placements[id].raw, __ATOMIC_RELAXED);
+  do {
+    placement = old;
+    if(pinned) {
+      placement.obj.flags |= SITE_PINNED;
+    } else {
+      placement.obj.flags &= ~SITE_PINNED;
+    }
+  } while(!__atomic_compare_exchange_n(&site_placements[id].raw, &old.raw, placement.raw,
+                                       0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* For SH_AGGREGATE_ARENAS: chooses a site's arena slot from its device and
+ * hotness class, so that each arena holds sites with the same placement needs.
+ * A site whose placement changes goes to its new group on its next allocation.
+ */
+static int get_group_arena(int id, sicm_device **device) {
+  site_placement placement;
+  int index, group;
+
+  placement = get_site_placement(id);
+  index = default_device_index;
+  if(placement.obj.flags & SITE_PLACED) {
+    index = placement.obj.device;
+  }
+  *device = device_list.devices[index];
+
+  group = (index * aggregate_classes) + (SITE_CLASS(placement) * aggregate_classes / SITE_NUM_CLASSES);
+  return (group * arenas_per_group) + (int) ((unsigned) id % arenas_per_group);
+}
+
+/* For the per-site layouts: whether a site should still allocate from its
+ * device's pooled arena, counting an allocation of `sz` bytes. Sites with
+ * guidance or online placement, and sites whose cumulative allocations reach
+ * the threshold, get their own arena from then on.
+ */
+static int site_is_small(int id, size_t sz) {
+  site_placement placement, large;
+  size_t bytes;
+
+  if((id < 0) || (id >= max_sites) || (id == should_profile_one)) {
+    return 0;
+  }
+
+  placement = get_site_placement(id);
+  if(placement.obj.flags & (SITE_PLACED | SITE_LARGE)) {
+    return 0;
+  }
+
+  bytes = __atomic_add_fetch(&site_bytes[id], sz, __ATOMIC_RELAXED);
+  if(bytes < small_site_threshold) {
+    return 1;
+  }
+
+  /* Promote the site to its own arena */
+  do {
+    large = placement;
+    large.obj.flags |= SITE_LARGE;
+  } while(!__atomic_compare_exchange_n(&site_placements[id].raw, &placement.raw, large.raw,
+                                       0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return 0;
+}
+
+/* Reads the "===== GUIDANCE =====" sections of a text guidance file.
+ * Each line is a site, the NUMA node that it goes onto, and optionally
+ * its hotness class. Returns 0 on success.
+ */
+static int read_text_guidance(char *path, guidance_map *map) {
+  char *str, *line, guidance, found_guidance;
+  FILE *guidance_file;
+  guidance_entry entry;
+  size_t len, max_sites_read;
+  int node, hotness;
+  unsigned site;
+
+  memset(map, 0, sizeof(guidance_map));
+
+  /* Open the file */
+  guidance_file = fopen(path, "r");
+  if(!guidance_file) {
+    fprintf(stderr, "Failed to open guidance file.\n");
+    return -1;
+  }
+
+  /* Read in the sites */
+  guidance = 0;
+  found_guidance = 0; /* Set if we find any site guidance at all */
+  line = NULL;
+  len = 0;
+  max_sites_read = 0;
+  while(getline(&line, &len, guidance_file) != -1) {
+    str = strtok(line, " ");
+    if(guidance) {
+      if(!str) continue;
+
+      /* Look to see if it's the end */
+      if(str && (strcmp(str, "=====") == 0)) {
+        str = strtok(NULL, " ");
+        if(str && (strcmp(str, "END") == 0)) {
+          guidance = 0;
+        } else {
+          fprintf(stderr, "In a guidance section, and found five equals signs, but not the end.\n");
+          goto error;
+        }
+        continue;
+      }
+
+      /* Read in the actual guidance now that we're in a guidance section */
+      sscanf(str, "%u", &site);
+      str = strtok(NULL, " ");
+      if(!str) {
+        fprintf(stderr, "Read in a site number from the guidance file, but no node number.\n");
+        goto error;
+      }
+      sscanf(str, "%d", &node);
+      /* The hotness class is optional */
+      hotness = 0;
+      str = strtok(NULL, " ");
+      if(str) {
+        sscanf(str, "%d", &hotness);
+      }
+
+      entry.site = site;
+      entry.node = (int16_t) node;
+      entry.hotness = (uint16_t) hotness;
+      if(map->num_sites == max_sites_read) {
+        max_sites_read = max_sites_read ? (max_sites_read * 2) : 64;
+        map->entries = realloc(map->entries, max_sites_read * sizeof(guidance_entry));
+      }
+      map->entries[map->num_sites++] = entry;
+    } else {
+      if(!str) continue;
+      /* Find the "===== GUIDANCE" tokens */
+      if(strcmp(str, "=====") != 0) continue;
+      str = strtok(NULL, " ");
+      if(str && (strcmp(str, "GUIDANCE") == 0)) {
+        /* Now we're in a guidance section */
+        guidance = 1;
+        found_guidance = 1;
+        continue;
+      }
+    }
+  }
+  if(!found_guidance) {
+    fprintf(stderr, "Didn't find any guidance in the file.\n");
+    goto error;
+  }
+  if(guidance) {
+    /* Probably a file that's still being written. Don't apply half of it. */
+    fprintf(stderr, "The guidance section has no end.\n");
+    goto error;
+  }
+
+  free(line);
+  fclose(guidance_file);
+  return 0;
+
+error:
+  free(line);
+  fclose(guidance_file);
+  sh_unmap_guidance(map);
+  return -1;
+}
+
+/* Moves a site to a device, or to the default device if `device` is NULL.
+ * If the site has an arena to itself, the arena's memory moves too; in the
+ * other layouts, the site's new placement applies to its next allocation.
+ */
+void sh_move_site(int id, sicm_device *device) {
+  sicm_device *old;
+  arena_info *arena;
+
+  old = get_site_device(id);
+  set_site_device(id, device);
+  if((old == get_site_device(id)) || !arenas.threads) {
+    return;
+  }
+  if((layout == SHARED_SITE_ARENAS) && !aggregate_arenas) {
+    arena = arena_table_get(&arenas, id);
+    if(arena) {
+      sicm_arena_set_device(arena->arena, get_site_device(id));
+    }
+  }
+}
+
+/* Applies one site's guidance, unless the site is pinned */
+static void guide_site(unsigned site, sicm_device *device, int hotness) {
+  if(get_site_placement(site).obj.flags & SITE_PINNED) {
+    return;
+  }
+  set_site_class(site, hotness);
+  sh_move_site(site, device);
+}
+
+/* Reads a guidance file, text or binary, and applies it. Sites that were in
+ * the last guidance, but aren't in this one, go back to the default device.
+ * Nothing changes if the file can't be read. Returns 0 on success.
+ */
+static int load_guidance(char *path, char verbose) {
+  guidance_map map;
+  guidance_entry *entry;
+  unsigned char *guided;
+  sicm_device *device;
+  uint32_t i;
+  int binary;
+
+  binary = sh_is_binary_guidance(path);
+  if(binary) {
+    if(sh_map_guidance(path, &map) != 0) {
+      return -1;
+    }
+  } else if(read_text_guidance(path, &map) != 0) {
+    return -1;
+  }
+
+  guided = (unsigned char *) calloc(max_sites, sizeof(unsigned char));
+  for(i = 0; i < map.num_sites; i++) {
+    entry = &map.entries[i];
+    device = get_device_from_numa_node(entry->node);
+    if(!device || (entry->site >= max_sites)) {
+      fprintf(stderr, "Ignoring guidance for site %u.\n", entry->site);
+      continue;
+    }
+    guide_site(entry->site, device, entry->hotness);
+    guided[entry->site] = 1;
+    if(verbose && !binary) {
+      printf("Adding site %u to NUMA node %d.\n", entry->site, entry->node);
+    }
+  }
+  printf("Read guidance for %u sites from %s.\n", map.num_sites, path);
+
+  if(guided_sites) {
+    for(i = 0; i < max_sites; i++) {
+      if(guided_sites[i] && !guided[i]) {
+        guide_site(i, NULL, 0);
+      }
+    }
+    free(guided_sites);
+  }
+  guided_sites = guided;
+
+  sh_unmap_guidance(&map);
+  return 0;
+}
+
+static void sh_request_guidance_reload(int sig) {
+  guidance_reload_requested = 1;
+}
+
+/* Installs the SIGHUP handler, unless the application already has one */
+static void sh_install_guidance_signal() {
+  struct sigaction act, old;
+
+  if((sigaction(SIGHUP, NULL, &old) != 0) ||
+     (old.sa_flags & SA_SIGINFO) || (old.sa_handler != SIG_DFL)) {
+    printf("SIGHUP already has a handler, so only reloading guidance on change.\n");
+    return;
+  }
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = &sh_request_guidance_reload;
+  act.sa_flags = SA_RESTART;
+  sigemptyset(&act.sa_mask);
+  sigaction(SIGHUP, &act, NULL);
+}
+
+/* Rereads the guidance file on SIGHUP, or when its modification time changes */
+static void *guidance_reload_thread(void *arg) {
+  struct stat st;
+  time_t mtime;
+
+  sh_internal_thread = 1;
+
+  mtime = 0;
+  if(stat(guidance_path, &st) == 0) {
+    mtime = st.st_mtime;
+  }
+
+  while(1) {
+    sleep(guidance_reload_interval);
+    if(stat(guidance_path, &st) != 0) {
+      continue;
+    }
+    if(!guidance_reload_requested && (st.st_mtime == mtime)) {
+      continue;
+    }
+    guidance_reload_requested = 0;
+    mtime = st.st_mtime;
+
+    /* Don't get cancelled halfway through */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    printf("Reloading guidance.\n");
+    load_guidance(guidance_path, 0);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  }
+
+  return NULL;
+}
 
 /* Gets environment variables and sets up globals */
 void set_options() {
-  char *env, *str, *line, guidance, found_guidance;
+  char *env, *str, *tok, *save;
   long long tmp_val;
   struct sicm_device *device;
-  int i, node;
-  FILE *guidance_file;
-  ssize_t len;
-  unsigned site;
-  tree_it(unsigned, deviceptr) it;
+  int i;
 
   /* Do we want to use the online approach, moving arenas around devices automatically? */
   env = getenv("SH_ONLINE_PROFILING");
   should_profile_online = 0;
   if(env) {
+    /* A comma-separated list of NUMA nodes, fastest first */
     should_profile_online = 1;
-    tmp_val = strtoimax(env, NULL, 10);
-    online_device = get_device_from_numa_node((int) tmp_val);
-    online_device_cap = sicm_avail(online_device) * 1024; /* sicm_avail() returns kilobytes */
-    printf("Doing online profiling, packing onto NUMA node %lld with a capacity of %zd.\n", tmp_val, online_device_cap);
+    online_tiers = (sicm_device **) calloc(device_list.count, sizeof(sicm_device *));
+    online_tier_caps = (ssize_t *) calloc(device_list.count, sizeof(ssize_t));
+    num_online_tiers = 0;
+    str = strdup(env);
+    for(tok = strtok_r(str, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+      if(num_online_tiers == device_list.count) {
+        fprintf(stderr, "More online profiling tiers than devices. Aborting.\n");
+        exit(1);
+      }
+      tmp_val = strtoimax(tok, NULL, 10);
+      device = get_device_from_numa_node((int) tmp_val);
+      if(!device) {
+        fprintf(stderr, "Online profiling tier %lld isn't a NUMA node. Aborting.\n", tmp_val);
+        exit(1);
+      }
+      online_tiers[num_online_tiers] = device;
+      online_tier_caps[num_online_tiers] = sicm_avail(device) * 1024; /* sicm_avail() returns kilobytes */
+      num_online_tiers++;
+    }
+    free(str);
+    if(!num_online_tiers) {
+      fprintf(stderr, "SH_ONLINE_PROFILING needs at least one NUMA node. Aborting.\n");
+      exit(1);
+    }
+
+    /* Optionally, a comma-separated list of capacities in bytes, one per tier */
+    env = getenv("SH_ONLINE_CAPS");
+    if(env) {
+      str = strdup(env);
+      i = 0;
+      for(tok = strtok_r(str, ",", &save); tok && (i < num_online_tiers); tok = strtok_r(NULL, ",", &save)) {
+        online_tier_caps[i++] = strtoimax(tok, NULL, 10);
+      }
+      free(str);
+    }
+    for(i = 0; i < num_online_tiers; i++) {
+      printf("Doing online profiling, packing tier %d onto NUMA node %d with a capacity of %zd.\n",
+             i, sicm_numa_id(online_tiers[i]), online_tier_caps[i]);
+    }
   }
 
   /* Get the arena layout */
@@ -228,6 +744,105 @@ void set_options() {
     }
   }
 
+  /* Where should the accesses come from? PEBS needs a PMU, which VMs and
+   * containers often don't have. The pagemap backend counts written pages.
+   */
+  profile_all_backend = PROFILE_BACKEND_PEBS;
+  if(should_profile_all) {
+    env = getenv("SH_PROFILE_ALL_BACKEND");
+    if(env) {
+      if(strcmp(env, "pebs") == 0) {
+        profile_all_backend = PROFILE_BACKEND_PEBS;
+      } else if(strcmp(env, "pagemap") == 0) {
+        profile_all_backend = PROFILE_BACKEND_PAGEMAP;
+      } else if(strcmp(env, "damon") == 0) {
+        profile_all_backend = PROFILE_BACKEND_DAMON;
+      } else {
+        fprintf(stderr, "Unknown profiling backend: %s. Aborting.\n", env);
+        exit(1);
+      }
+      printf("Profiling backend: %s\n", env);
+    }
+  }
+
+  /* Should DAMON move pages between nodes itself, as it finds them hot or
+   * cold? The value is the hot node and the cold node, either of which can
+   * be left empty. Its schemes cover every extent, so it would fight
+   * whatever placement online profiling or guidance gives a site.
+   */
+  damon_hot_node = -1;
+  damon_cold_node = -1;
+  env = getenv("SH_DAMON_MIGRATE");
+  if(env && (should_profile_online || getenv("SH_GUIDANCE_FILE"))) {
+    printf("Ignoring SH_DAMON_MIGRATE, because online profiling or guidance places the sites.\n");
+  } else if(env && should_profile_all && (profile_all_backend == PROFILE_BACKEND_DAMON)) {
+    str = strchr(env, ',');
+    if(env[0] && (env[0] != ',')) {
+      damon_hot_node = (int) strtol(env, NULL, 10);
+    }
+    if(str && str[1]) {
+      damon_cold_node = (int) strtol(str + 1, NULL, 10);
+    }
+  }
+
+  /* Should load samples carry their latency and data source, so that sites
+   * are ranked by the time spent waiting on memory instead of by misses?
+   * The value is the minimum latency of a sampled load, in cycles.
+   */
+  profile_all_latency = 0;
+  profile_all_stores = 0;
+  if(should_profile_all && (profile_all_backend == PROFILE_BACKEND_PEBS)) {
+    env = getenv("SH_PROFILE_ALL_LATENCY");
+    if(env) {
+      tmp_val = strtoimax(env, NULL, 10);
+      profile_all_latency = 32;
+      if((tmp_val <= 0) || (tmp_val > INT_MAX)) {
+        printf("Invalid load latency given. Defaulting to %d cycles.\n", profile_all_latency);
+      } else {
+        profile_all_latency = (int) tmp_val;
+      }
+      printf("Weighting loads of at least %d cycles by their latency.\n", profile_all_latency);
+    }
+
+    /* Should stores be sampled too? */
+    if(getenv("SH_PROFILE_ALL_STORES")) {
+      profile_all_stores = 1;
+      printf("Sampling stores.\n");
+    }
+  }
+
+  /* How fast should online profiling forget old accesses? Each interval, a
+   * site's rate moves this fraction of the way to its latest interval. 0
+   * ranks sites by their totals since startup.
+   */
+  profile_all_decay = 0.5;
+  phase_threshold = 0.5;
+  if(should_profile_all) {
+    env = getenv("SH_PROFILE_ALL_DECAY");
+    if(env) {
+      profile_all_decay = strtof(env, NULL);
+      if((profile_all_decay < 0) || (profile_all_decay > 1)) {
+        profile_all_decay = 0.5;
+        printf("Invalid decay given. Defaulting to %.2f.\n", profile_all_decay);
+      }
+      printf("Decaying site rates by %.2f per interval.\n", profile_all_decay);
+    }
+
+    /* How different do the last few intervals have to be from the current
+     * phase to start a new one? The distance is between the fractions of
+     * the accesses that went to each site, so it's between 0 and 2. 0 turns
+     * phase detection off.
+     */
+    env = getenv("SH_PROFILE_ALL_PHASE_THRESHOLD");
+    if(env) {
+      phase_threshold = strtof(env, NULL);
+      if(phase_threshold < 0) {
+        phase_threshold = 0;
+      }
+      printf("Phase threshold: %.2f\n", phase_threshold);
+    }
+  }
+
   /* Should we profile (by isolating) a single allocation site onto a NUMA node
    * and getting the memory bandwidth on that node?  Pass the allocation site
    * ID as the value of this environment variable.
@@ -320,6 +935,27 @@ void set_options() {
     }
   }
 
+  /* How many threads scan the pagemap for RSS */
+  profile_rss_threads = 1;
+  if(should_profile_rss) {
+    env = getenv("SH_PROFILE_RSS_THREADS");
+    if(env) {
+      profile_rss_threads = (int) strtol(env, NULL, 10);
+      if(profile_rss_threads < 1) {
+        profile_rss_threads = 1;
+      }
+      printf("Scanning for RSS with %d threads.\n", profile_rss_threads);
+    }
+  }
+
+  /* Should each profiling interval be written to a CSV file as it happens? */
+  profile_output_path = NULL;
+  env = getenv("SH_PROFILE_OUTPUT");
+  if(env && (should_profile_all || should_profile_one || should_profile_rss)) {
+    profile_output_path = env;
+    printf("Writing profiling intervals to %s.\n", profile_output_path);
+  }
+
 
   /* What sample frequency should we use? Default is 2048. Higher
    * frequencies will fill up the sample pages (below) faster.
@@ -368,6 +1004,35 @@ void set_options() {
   }
   printf("Default device: %s\n", sicm_device_tag_str(default_device->tag));
 
+  default_device_index = get_device_index(default_device);
+
+  /* Should sites share a fixed number of arenas, instead of getting their own?
+   * For applications with more sites than jemalloc can have arenas.
+   */
+  env = getenv("SH_AGGREGATE_ARENAS");
+  aggregate_arenas = 0;
+  if(env) {
+    if(layout == SHARED_SITE_ARENAS) {
+      tmp_val = strtoimax(env, NULL, 10);
+      if((tmp_val < device_list.count) || (tmp_val > max_arenas)) {
+        aggregate_arenas = device_list.count;
+        printf("Invalid number of aggregate arenas given. Defaulting to %d.\n", aggregate_arenas);
+      } else {
+        aggregate_arenas = (int) tmp_val;
+      }
+      /* At least one arena per device; split by hotness class if there's room */
+      aggregate_classes = aggregate_arenas / device_list.count;
+      if(aggregate_classes > SITE_NUM_CLASSES) {
+        aggregate_classes = SITE_NUM_CLASSES;
+      }
+      arenas_per_group = aggregate_arenas / (device_list.count * aggregate_classes);
+      printf("Aggregating sites into %d arenas, %d hotness classes per device.\n",
+             aggregate_arenas, aggregate_classes);
+    } else {
+      printf("Can't aggregate arenas, because we're using the wrong arena layout.\n");
+    }
+  }
+
   /* Get arenas_per_thread */
   switch(layout) {
     case SHARED_ONE_ARENA:
@@ -381,6 +1046,9 @@ void set_options() {
     case SHARED_SITE_ARENAS:
     case EXCLUSIVE_SITE_ARENAS:
       arenas_per_thread = max_arenas;
+      if(aggregate_arenas) {
+        arenas_per_thread = aggregate_arenas;
+      }
       break;
     case EXCLUSIVE_TWO_DEVICE_ARENAS:
       arenas_per_thread = 2 * num_numa_nodes; //((int) device_list.count);
@@ -394,77 +1062,107 @@ void set_options() {
   };
   printf("Arenas per thread: %d\n", arenas_per_thread);
 
+  env = getenv("SH_NUM_STATIC_SITES");
+  if (env) {
+    tmp_val = strtoimax(env, NULL, 10);
+    if((tmp_val == 0) || (tmp_val > INT_MAX)) {
+      printf("Invalid number of static sites given.\n");
+    } else {
+      num_static_sites = (int) tmp_val;
+    }
+  }
+  printf("Number of static sites: %d\n", num_static_sites);
+
+  /* One placement per site ID. Site IDs start at 1, and the per-site
+   * layouts use them directly as arena indices.
+   */
+  max_sites = max_arenas;
+  if(num_static_sites && (num_static_sites < max_arenas)) {
+    max_sites = num_static_sites + 1;
+  }
+  site_placements = (site_placement *) calloc(max_sites, sizeof(site_placement));
+
+  /* Should small sites share an arena per device, instead of getting their own?
+   * The value is the number of bytes that a site has to allocate in total,
+   * over the whole run and regardless of frees, to get its own arena.
+   */
+  env = getenv("SH_SMALL_SITE_CUMULATIVE_BYTES");
+  small_site_threshold = 0;
+  if(env && !aggregate_arenas && ((layout == SHARED_SITE_ARENAS) || (layout == EXCLUSIVE_SITE_ARENAS))) {
+    tmp_val = strtoimax(env, NULL, 10);
+    if(tmp_val <= 0) {
+      printf("Invalid small site threshold given. Not pooling small sites.\n");
+    } else {
+      small_site_threshold = (size_t) tmp_val;
+      site_bytes = (size_t *) calloc(max_sites, sizeof(size_t));
+      /* The pooled arenas go after the per-site ones */
+      pool_base = arenas_per_thread;
+      arenas_per_thread += device_list.count;
+      printf("Pooling sites until they've allocated %zu bytes in total.\n", small_site_threshold);
+    }
+  }
+
   /* Get the guidance file that tells where each site goes */
   env = getenv("SH_GUIDANCE_FILE");
+  guidance_path = NULL;
   if(env) {
-    /* Open the file */
-    guidance_file = fopen(env, "r");
-    if(!guidance_file) {
-      fprintf(stderr, "Failed to open guidance file. Aborting.\n");
+    guidance_path = env;
+    if(load_guidance(guidance_path, 1) != 0) {
+      fprintf(stderr, "Failed to read guidance. Aborting.\n");
       exit(1);
     }
 
-    /* Read in the sites */
-    guidance = 0;
-    found_guidance = 0; /* Set if we find any site guidance at all */
-    line = NULL;
-    len = 0;
-    while(getline(&line, &len, guidance_file) != -1) {
-      str = strtok(line, " ");
-      if(guidance) {
-        if(!str) continue;
-
-        /* Look to see if it's the end */
-        if(str && (strcmp(str, "=====") == 0)) {
-          str = strtok(NULL, " ");
-          if(str && (strcmp(str, "END") == 0)) {
-            guidance = 0;
-          } else {
-            fprintf(stderr, "In a guidance section, and found five equals signs, but not the end. Aborting.\n");
-            exit(1);
-          }
-          continue;
-        }
-
-        /* Read in the actual guidance now that we're in a guidance section */
-        sscanf(str, "%u", &site);
-        str = strtok(NULL, " ");
-        if(!str) {
-          fprintf(stderr, "Read in a site number from the guidance file, but no node number. Aborting.\n");
-          exit(1);
-        }
-        sscanf(str, "%d", &node);
-        tree_insert(site_nodes, site, get_device_from_numa_node(node));
-        printf("Adding site %u to NUMA node %d.\n", site, node);
+    /* Should we reread the guidance on SIGHUP, or when the file changes?
+     * The value is how often to check the file, in seconds. SIGHUP is only
+     * used if the application leaves it at the default action. Tools that
+     * rewrite the file should write a new one and rename it over the old.
+     */
+    env = getenv("SH_GUIDANCE_RELOAD");
+    guidance_reload_interval = 0;
+    if(env) {
+      tmp_val = strtoimax(env, NULL, 10);
+      guidance_reload_interval = 1;
+      if((tmp_val <= 0) || (tmp_val > INT_MAX)) {
+        printf("Invalid guidance reload interval given. Defaulting to %d.\n", guidance_reload_interval);
       } else {
-        if(!str) continue;
-        /* Find the "===== GUIDANCE" tokens */
-        if(strcmp(str, "=====") != 0) continue;
-        str = strtok(NULL, " ");
-        if(str && (strcmp(str, "GUIDANCE") == 0)) {
-          /* Now we're in a guidance section */
-          guidance = 1;
-          found_guidance = 1;
-          continue;
-        }
+        guidance_reload_interval = (int) tmp_val;
       }
-    }
-    if(!found_guidance) {
-      fprintf(stderr, "Didn't find any guidance in the file. Aborting.\n");
-      exit(1);
+      printf("Reloading guidance on SIGHUP or on change, checking every %d seconds.\n", guidance_reload_interval);
     }
   }
 
-  env = getenv("SH_NUM_STATIC_SITES");
-  if (env) {
-    tmp_val = strtoimax(env, NULL, 10);
-    if((tmp_val == 0) || (tmp_val > INT_MAX)) {
-      printf("Invalid number of static sites given.\n");
-    } else {
-      num_static_sites = (int) tmp_val;
+  /* Should we listen for commands on a UNIX socket at this path? */
+  control_socket_path = getenv("SH_CONTROL_SOCKET");
+  if(control_socket_path) {
+    printf("Listening for commands on %s.\n", control_socket_path);
+  }
+
+  /* Should we count allocations, frees and sizes for each site? */
+  should_count_allocations = 0;
+  if(getenv("SH_COUNT_ALLOCATIONS") && (layout != INVALID_LAYOUT)) {
+    should_count_allocations = 1;
+    printf("Counting allocations per site.\n");
+  }
+
+  /* Should we sample how long each site's objects live? The value is
+   * how many allocations each thread makes per sample.
+   */
+  lifetime_sample_rate = 0;
+  env = getenv("SH_PROFILE_LIFETIMES");
+  if(env && (layout != INVALID_LAYOUT)) {
+    lifetime_sample_rate = strtol(env, NULL, 10);
+    if(lifetime_sample_rate < 1) {
+      lifetime_sample_rate = 1;
     }
+    /* Objects freed within this many microseconds are short-lived */
+    short_lifetime_us = 1000;
+    env = getenv("SH_SHORT_LIFETIME");
+    if(env) {
+      short_lifetime_us = strtol(env, NULL, 10);
+    }
+    printf("Sampling one in %ld allocations for lifetimes, short-lived under %ldus.\n",
+           lifetime_sample_rate, short_lifetime_us);
   }
-  printf("Number of static sites: %d\n", num_static_sites);
 
   env = getenv("SH_RDSPY");
   should_run_rdspy = 0;
@@ -479,138 +1177,206 @@ void set_options() {
   }
 }
 
+/* Destructor for `thread_key`. Puts the exiting thread's index back in the pool. */
+static void sh_release_thread_index(void *val) {
+  pthread_mutex_lock(&thread_lock);
+  free_thread_indices[num_free_thread_indices++] = *((int *) val);
+  pthread_mutex_unlock(&thread_lock);
+}
+
 int get_thread_index() {
   int *val;
 
   /* Get this thread's index */
   val = (int *) pthread_getspecific(thread_key);
 
-  /* If nonexistent, increment the counter and set it */
+  /* If nonexistent, reuse the index of a thread that has exited,
+   * or take a new one if there isn't one.
+   */
   if(val == NULL) {
-    if(thread_indices + 1 >= max_thread_indices) {
+    pthread_mutex_lock(&thread_lock);
+    if(num_free_thread_indices) {
+      /* Most recently freed first, since its arenas are the warmest */
+      val = &thread_indices[free_thread_indices[--num_free_thread_indices]];
+    } else if(num_thread_indices < max_threads) {
+      val = &thread_indices[num_thread_indices++];
+    } else {
       fprintf(stderr, "Maximum number of threads reached. Aborting.\n");
       exit(1);
     }
-    pthread_setspecific(thread_key, (void *) thread_indices);
-    val = thread_indices;
-    thread_indices++;
+    pthread_mutex_unlock(&thread_lock);
+    pthread_setspecific(thread_key, (void *) val);
   }
 
   return *val;
 }
 
-/* Adds an arena to the `arenas` array. */
+/* Adds an arena to the `arenas` array.
+ * Must be called with `arena_lock` held. Readers don't take the lock, so
+ * the arena is fully initialized before its pointer is published.
+ */
 void sh_create_arena(int index, int id, sicm_device *device) {
-  if(index > (max_arenas - 1)) {
-    /* TODO: handle this more gracefully */
-    fprintf(stderr, "Maximum number of arenas reached. Aborting.\n");
-    exit(1);
-  }
+  arena_info *arena;
 
   /* If we've already created this arena */
-  if(arenas[index] != NULL) {
+  if(arena_table_get(&arenas, index) != NULL) {
     return;
   }
 
-  /* Put an upper bound on the indices that need to be searched */
-  if(index > max_index) {
-    max_index = index;
+  if((index & ((1 << arenas.thread_shift) - 1)) >= arenas_per_thread) {
+    fprintf(stderr, "Arena slot out of range. Aborting.\n");
+    exit(1);
   }
+  if(num_arenas >= max_arenas) {
+    /* TODO: handle this more gracefully */
+    fprintf(stderr, "Maximum number of arenas reached. Aborting.\n");
+    exit(1);
+  }
+  num_arenas++;
 
   if(!device) {
     device = default_device;
   }
 
   /* Create the arena if it doesn't exist */
-  arenas[index] = calloc(1, sizeof(arena_info));
-  arenas[index]->index = index;
-  arenas[index]->accesses = 0;
-  arenas[index]->id = id;
-  arenas[index]->rss = 0;
-  arenas[index]->peak_rss = 0;
-  arenas[index]->arena = sicm_arena_create(0, device);
+  arena = calloc(1, sizeof(arena_info));
+  arena->index = index;
+  arena->accesses = 0;
+  arena->id = id;
+  arena->rss = 0;
+  arena->peak_rss = 0;
+  creating_arena = arena;
+  arena->arena = sicm_arena_create(0, device);
+
+  /* Frees from an arena that belongs to one site are counted for that site */
+  if(should_count_allocations && (id != POOL_SITE_ID) &&
+     ((layout == SHARED_SITE_ARENAS) || (layout == EXCLUSIVE_SITE_ARENAS))) {
+    sh_counters_set_arena_site(arena->arena, id);
+  }
+
+  /* Put an upper bound on the indices that need to be searched */
+  if(index > max_index) {
+    max_index = index;
+  }
+
+  /* Publishes the arena to readers, which don't take the lock */
+  arena_table_set(&arenas, index, arena);
+  creating_arena = NULL;
 }
 
 /* Adds an extent to the `extents` array. */
 void sh_create_extent(void *start, void *end) {
-  int thread_index, arena_index;
+  int arena_index;
+  arena_info *arena;
 
-  /* Get this thread's current arena index from `pending_indices` */
-  thread_index = get_thread_index();
-  arena_index = pending_indices[thread_index];
+  /* Get this thread's current arena index */
+  arena_index = pending_index;
 
   /* A extent allocation is happening without an sh_alloc... */
-  if(arena_index == 0) {
+  if(arena_index < 0) {
     fprintf(stderr, "Unknown extent allocation. Aborting.\n");
     exit(1);
   }
 
-  if(should_profile_rss && (arenas[arena_index]->id == should_profile_one)) {
+  arena = arena_table_get(&arenas, arena_index);
+  if(!arena) {
+    /* The arena's first extent, allocated while it's being created */
+    arena = creating_arena;
+  }
+  if(!arena) {
+    fprintf(stderr, "Extent allocated for an arena that doesn't exist. Aborting.\n");
+    exit(1);
+  }
+
+  if(should_profile_rss && (arena->id == should_profile_one)) {
     /* If we're profiling RSS and this is the site that we're isolating */
-    extent_arr_insert(rss_extents, start, end, arenas[arena_index]);
+    extent_arr_insert(rss_extents, start, end, arena);
   }
 
   if(pthread_rwlock_wrlock(&extents_lock) != 0) {
     fprintf(stderr, "Failed to acquire read/write lock. Aborting.\n");
     exit(1);
   }
-  extent_arr_insert(extents, start, end, arenas[arena_index]);
+  extent_arr_insert(extents, start, end, arena);
+  extents_version++;
   if(pthread_rwlock_unlock(&extents_lock) != 0) {
     fprintf(stderr, "Failed to unlock read/write lock. Aborting.\n");
     exit(1);
   }
 }
 
-/* Gets the device that this site should go onto from the site_nodes tree */
+/* Gets the device that this site should go onto from its placement */
 sicm_device *get_site_device(int id) {
-  sicm_device *device;
-  tree_it(unsigned, deviceptr) it;
+  site_placement placement;
 
-  it = tree_lookup(site_nodes, id);
-  if(tree_it_good(it)) {
-    /* This site was found in the guidance file.  Use its device pointer to
-     * find if this device has already got an arena.
-     */
-    device = tree_it_val(it);
-  } else {
-    /* Site's not in the guidance file. Use the default device. */
-    device = default_device;
+  placement = get_site_placement(id);
+  if(placement.obj.flags & SITE_PLACED) {
+    /* This site was given a device by guidance or online profiling */
+    return device_list.devices[placement.obj.device];
   }
 
-  return device;
+  /* Site's not in the guidance file. Use the default device. */
+  return default_device;
 }
 
-/* Chooses an arena for the per-device arena layouts. */
+/* Chooses an arena slot for the per-device arena layouts. */
 int get_device_arena(int id, sicm_device **device) {
-  tree_it(deviceptr, int) devit;
-  int ret;
+  site_placement placement, cached;
+  int ret, index;
 
-  *device = get_site_device(id);
-  devit = tree_lookup(device_arenas, *device);
-  if(tree_it_good(devit)) {
-    /* This device already has an arena associated with it. Return the
-     * index of that arena.
-     */
-    ret = tree_it_val(devit);
+  placement = get_site_placement(id);
+  if(placement.obj.flags & SITE_PLACED) {
+    *device = device_list.devices[placement.obj.device];
   } else {
-    /* Choose an arena index for this device.  We're going to assume here
-     * that we never get a device that didn't exist on initialization.
-     * Remember our choice.
-     */
-    ret = max_index + 1;
-    tree_insert(device_arenas, *device, ret);
+    *device = default_device;
+  }
+
+  /* The site already knows its device's slot */
+  if(placement.obj.flags & SITE_HAS_ARENA) {
+    return placement.obj.arena;
+  }
+
+  /* Look up the slot of the device, choosing one if this is the device's
+   * first allocation. We're going to assume here that we never get a device
+   * that didn't exist on initialization.
+   */
+  index = get_device_index(*device);
+  ret = __atomic_load_n(&device_arenas[index], __ATOMIC_ACQUIRE);
+  if(!ret) {
+    pthread_mutex_lock(&arena_lock);
+    ret = device_arenas[index];
+    if(!ret) {
+      ret = ++num_device_arenas;
+      __atomic_store_n(&device_arenas[index], ret, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&arena_lock);
+  }
+  ret--;
+
+  /* Remember the slot in the site's placement, unless the placement
+   * changed in the meantime.
+   */
+  if((id >= 0) && (id < max_sites)) {
+    cached = placement;
+    cached.obj.arena = (uint32_t) ret;
+    cached.obj.flags |= SITE_HAS_ARENA;
+    __atomic_compare_exchange_n(&site_placements[id].raw, &placement.raw, cached.raw,
+                                0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
   }
 
   return ret;
 }
 
-/* Gets the index that the ID should go into */
-int get_arena_index(int id) {
-  int ret, thread_index;
+/* Gets the index that the ID should go into for a given layout,
+ * for an allocation of `sz` bytes.
+ * Always inlined, and each layout gets its own copy of sh_alloc and sh_realloc
+ * with `layout` as a constant, so the switch folds away.
+ */
+static inline __attribute__((always_inline))
+int layout_arena_index(enum arena_layout layout, int id, size_t sz) {
+  int ret;
   sicm_device *device;
 
-  thread_index = get_thread_index();
-
   ret = 0;
   device = NULL;
   switch(layout) {
@@ -618,17 +1384,28 @@ int get_arena_index(int id) {
       ret = 0;
       break;
     case EXCLUSIVE_ONE_ARENA:
-      ret = thread_index + 1;
+      ret = arena_table_index(&arenas, get_thread_index(), 0);
       break;
     case SHARED_DEVICE_ARENAS:
       ret = get_device_arena(id, &device);
       break;
     case EXCLUSIVE_DEVICE_ARENAS:
+    case EXCLUSIVE_TWO_DEVICE_ARENAS:
+    case EXCLUSIVE_FOUR_DEVICE_ARENAS:
       /* Same as SHARED_DEVICE_ARENAS, except per thread */
       ret = get_device_arena(id, &device);
-      ret = (thread_index * arenas_per_thread) + ret;
+      ret = arena_table_index(&arenas, get_thread_index(), ret);
       break;
     case SHARED_SITE_ARENAS:
+      if(aggregate_arenas) {
+        ret = get_group_arena(id, &device);
+        id = POOL_SITE_ID;
+        break;
+      }
+      if((id < 0) || (id >= max_arenas)) {
+        fprintf(stderr, "Site ID %d is out of range. Aborting.\n", id);
+        exit(1);
+      }
       ret = id;
       device = get_site_device(id);
       /* Special case for profiling */
@@ -636,16 +1413,22 @@ int get_arena_index(int id) {
         /* If the site is the one we're profiling, isolate it */
         device = profile_one_device;
       }
+      if(small_site_threshold && site_is_small(id, sz)) {
+        ret = pool_base + get_device_index(device);
+        id = POOL_SITE_ID;
+      }
       break;
     case EXCLUSIVE_SITE_ARENAS:
-      ret = (thread_index * arenas_per_thread) + id;
-      break;
-    case EXCLUSIVE_TWO_DEVICE_ARENAS:
-      ret = get_device_arena(id, &device);
-      ret = (thread_index * arenas_per_thread) + ret;
-    case EXCLUSIVE_FOUR_DEVICE_ARENAS:
-      ret = get_device_arena(id, &device);
-      ret = (thread_index * arenas_per_thread) + ret;
+      if((id < 0) || (id >= max_arenas)) {
+        fprintf(stderr, "Site ID %d is out of range. Aborting.\n", id);
+        exit(1);
+      }
+      ret = id;
+      if(small_site_threshold && site_is_small(id, sz)) {
+        ret = pool_base + default_device_index;
+        id = POOL_SITE_ID;
+      }
+      ret = arena_table_index(&arenas, get_thread_index(), ret);
       break;
     default:
       fprintf(stderr, "Invalid arena layout. Aborting.\n");
@@ -653,70 +1436,367 @@ int get_arena_index(int id) {
       break;
   };
 
-  pending_indices[thread_index] = ret;
-  pthread_mutex_lock(&arena_lock);
-  sh_create_arena(ret, id, device);
-  pthread_mutex_unlock(&arena_lock);
+  pending_index = ret;
+
+  /* The arena almost always exists already, so only take the lock
+   * if it has to be created. sh_create_arena checks again under the lock.
+   */
+  if(!arena_table_get(&arenas, ret)) {
+    pthread_mutex_lock(&arena_lock);
+    sh_create_arena(ret, id, device);
+    pthread_mutex_unlock(&arena_lock);
+  }
 
   return ret;
 }
 
-void* sh_realloc(int id, void *ptr, size_t sz) {
-  int   index;
-  void *ret;
+/* Gets the index that the ID should go into */
+int get_arena_index(int id) {
+  return layout_arena_index(layout, id, 0);
+}
+
+static void *sh_alloc_default(int id, size_t sz) {
+  return je_malloc(sz);
+}
+
+static void *sh_calloc_default(int id, size_t num, size_t sz) {
+  return je_calloc(num, sz);
+}
 
-  if(layout == INVALID_LAYOUT) {
-    ret = realloc(ptr, sz);
+static void *sh_realloc_default(int id, void *ptr, size_t sz) {
+  return je_realloc(ptr, sz);
+}
+
+static void *sh_alloc_aligned_default(int id, size_t sz, size_t align) {
+  return je_aligned_alloc(align, sz);
+}
+
+/* Frees with the size and alignment that the caller knows, if any (zero if not).
+ * Same for every layout, since jemalloc finds the arena from the pointer.
+ */
+static void sh_free_sized_default(void *ptr, size_t sz, size_t align) {
+  int flags;
+
+  if(!ptr) {
+    return;
+  }
+
+  flags = 0;
+  if(align) {
+    flags = MALLOCX_ALIGN(align);
+  }
+  if(sz) {
+    je_sdallocx(ptr, sz, flags);
   } else {
-    index = get_arena_index(id);
-    ret = sicm_arena_realloc(arenas[index]->arena, ptr, sz);
+    je_dallocx(ptr, flags);
   }
+}
 
-  if (should_run_rdspy) {
-    sh_rdspy_realloc(ptr, ret, sz, id);
+/* Defines sh_alloc_LAYOUT, sh_calloc_LAYOUT, sh_realloc_LAYOUT and
+ * sh_alloc_aligned_LAYOUT for one arena layout.
+ */
+#define sh_layout_entry_points(LAYOUT) \
+  static void *sh_alloc_##LAYOUT(int id, size_t sz) { \
+    if(!sz) { \
+      return je_malloc(sz); \
+    } \
+    return sicm_arena_alloc(arena_table_get(&arenas, layout_arena_index(LAYOUT, id, sz))->arena, sz); \
+  } \
+  static void *sh_calloc_##LAYOUT(int id, size_t num, size_t sz) { \
+    size_t total; \
+    if(__builtin_mul_overflow(num, sz, &total)) { \
+      return NULL; \
+    } \
+    if(!total) { \
+      return je_malloc(0); \
+    } \
+    return sicm_arena_calloc(arena_table_get(&arenas, layout_arena_index(LAYOUT, id, total))->arena, num, sz); \
+  } \
+  /* Grows in place if it can, or moves to the site's current arena */ \
+  static void *sh_realloc_##LAYOUT(int id, void *ptr, size_t sz) { \
+    return sicm_arena_realloc(arena_table_get(&arenas, layout_arena_index(LAYOUT, id, sz))->arena, ptr, sz); \
+  } \
+  static void *sh_alloc_aligned_##LAYOUT(int id, size_t sz, size_t align) { \
+    if(!sz) { \
+      return je_aligned_alloc(align, sz); \
+    } \
+    return sicm_arena_alloc_aligned(arena_table_get(&arenas, layout_arena_index(LAYOUT, id, sz))->arena, sz, align); \
   }
 
+sh_layout_entry_points(SHARED_ONE_ARENA)
+sh_layout_entry_points(EXCLUSIVE_ONE_ARENA)
+sh_layout_entry_points(SHARED_DEVICE_ARENAS)
+sh_layout_entry_points(EXCLUSIVE_DEVICE_ARENAS)
+sh_layout_entry_points(SHARED_SITE_ARENAS)
+sh_layout_entry_points(EXCLUSIVE_SITE_ARENAS)
+sh_layout_entry_points(EXCLUSIVE_TWO_DEVICE_ARENAS)
+sh_layout_entry_points(EXCLUSIVE_FOUR_DEVICE_ARENAS)
+
+#define sh_layout_dispatch(LAYOUT) \
+  case LAYOUT: \
+    dispatch.alloc = sh_alloc_##LAYOUT; \
+    dispatch.calloc = sh_calloc_##LAYOUT; \
+    dispatch.realloc = sh_realloc_##LAYOUT; \
+    dispatch.alloc_aligned = sh_alloc_aligned_##LAYOUT; \
+    dispatch.free = sicm_free; \
+    break;
+
+/* Entry points that also report to rdspy */
+static void *sh_alloc_rdspy(int id, size_t sz) {
+  void *ret;
+
+  ret = rdspy_dispatch.alloc(id, sz);
+  sh_rdspy_alloc(ret, sz, id);
   return ret;
 }
 
-/* Accepts an allocation site ID and a size, does the allocation */
-void* sh_alloc(int id, size_t sz) {
-  int index;
+static void *sh_calloc_rdspy(int id, size_t num, size_t sz) {
   void *ret;
 
-  if((layout == INVALID_LAYOUT) || !sz) {
-    ret = je_malloc(sz);
-  } else {
-    index = get_arena_index(id);
-    ret = sicm_arena_alloc(arenas[index]->arena, sz);
+  ret = rdspy_dispatch.calloc(id, num, sz);
+  sh_rdspy_alloc(ret, num * sz, id);
+  return ret;
+}
+
+static void *sh_realloc_rdspy(int id, void *ptr, size_t sz) {
+  void *ret;
+
+  ret = rdspy_dispatch.realloc(id, ptr, sz);
+  sh_rdspy_realloc(ptr, ret, sz, id);
+  return ret;
+}
+
+static void *sh_alloc_aligned_rdspy(int id, size_t sz, size_t align) {
+  void *ret;
+
+  ret = rdspy_dispatch.alloc_aligned(id, sz, align);
+  sh_rdspy_alloc(ret, sz, id);
+  return ret;
+}
+
+static void sh_free_rdspy(void *ptr) {
+  sh_rdspy_free(ptr);
+  rdspy_dispatch.free(ptr);
+}
+
+static void sh_free_sized_rdspy(void *ptr, size_t sz, size_t align) {
+  sh_rdspy_free(ptr);
+  rdspy_dispatch.free_sized(ptr, sz, align);
+}
+
+/* Entry points that also count allocations per site */
+static void *sh_alloc_count(int id, size_t sz) {
+  void *ret;
+
+  ret = count_dispatch.alloc(id, sz);
+  sh_counters_alloc(id, ret);
+  return ret;
+}
+
+static void *sh_calloc_count(int id, size_t num, size_t sz) {
+  void *ret;
+
+  ret = count_dispatch.calloc(id, num, sz);
+  sh_counters_alloc(id, ret);
+  return ret;
+}
+
+/* The old pointer is only counted as freed if the realloc succeeded */
+static void *sh_realloc_count(int id, void *ptr, size_t sz) {
+  counted_ptr old;
+  void *ret;
+
+  sh_counters_lookup(ptr, &old);
+  ret = count_dispatch.realloc(id, ptr, sz);
+  if(ret || !sz) {
+    sh_counters_freed(&old);
   }
+  sh_counters_alloc(id, ret);
+  return ret;
+}
 
-  if (should_run_rdspy) {
-    sh_rdspy_alloc(ret, sz, id);
+static void *sh_alloc_aligned_count(int id, size_t sz, size_t align) {
+  void *ret;
+
+  ret = count_dispatch.alloc_aligned(id, sz, align);
+  sh_counters_alloc(id, ret);
+  return ret;
+}
+
+static void sh_free_count(void *ptr) {
+  counted_ptr old;
+
+  sh_counters_lookup(ptr, &old);
+  count_dispatch.free(ptr);
+  sh_counters_freed(&old);
+}
+
+static void sh_free_sized_count(void *ptr, size_t sz, size_t align) {
+  counted_ptr old;
+
+  sh_counters_lookup(ptr, &old);
+  count_dispatch.free_sized(ptr, sz, align);
+  sh_counters_freed(&old);
+}
+
+/* Entry points that also sample object lifetimes */
+static void *sh_alloc_lifetime(int id, size_t sz) {
+  void *ret;
+
+  ret = lifetime_dispatch.alloc(id, sz);
+  sh_lifetime_alloc(id, ret);
+  return ret;
+}
+
+static void *sh_calloc_lifetime(int id, size_t num, size_t sz) {
+  void *ret;
+
+  ret = lifetime_dispatch.calloc(id, num, sz);
+  sh_lifetime_alloc(id, ret);
+  return ret;
+}
+
+/* A realloc'd object keeps its allocation time, wherever it ends up */
+static void *sh_realloc_lifetime(int id, void *ptr, size_t sz) {
+  uint64_t birth;
+  uint32_t site;
+  int sampled;
+  void *ret;
+
+  sampled = sh_lifetime_remove(ptr, &site, &birth);
+  ret = lifetime_dispatch.realloc(id, ptr, sz);
+  if(sampled) {
+    sh_lifetime_move(ret ? ret : ptr, site, birth);
+  } else if(!ptr) {
+    sh_lifetime_alloc(id, ret);
   }
-  
   return ret;
 }
 
-void* sh_calloc(int id, size_t num, size_t sz) {
-  void *ptr;
-  size_t i;
+static void *sh_alloc_aligned_lifetime(int id, size_t sz, size_t align) {
+  void *ret;
+
+  ret = lifetime_dispatch.alloc_aligned(id, sz, align);
+  sh_lifetime_alloc(id, ret);
+  return ret;
+}
+
+static void sh_free_lifetime(void *ptr) {
+  sh_lifetime_free(ptr);
+  lifetime_dispatch.free(ptr);
+}
+
+static void sh_free_sized_lifetime(void *ptr, size_t sz, size_t align) {
+  sh_lifetime_free(ptr);
+  lifetime_dispatch.free_sized(ptr, sz, align);
+}
+
+/* Chooses the allocation entry points. Called once from sh_init,
+ * after the options are read and before any allocation goes to an arena.
+ */
+static void sh_set_dispatch() {
+  switch(layout) {
+    sh_layout_dispatch(SHARED_ONE_ARENA)
+    sh_layout_dispatch(EXCLUSIVE_ONE_ARENA)
+    sh_layout_dispatch(SHARED_DEVICE_ARENAS)
+    sh_layout_dispatch(EXCLUSIVE_DEVICE_ARENAS)
+    sh_layout_dispatch(SHARED_SITE_ARENAS)
+    sh_layout_dispatch(EXCLUSIVE_SITE_ARENAS)
+    sh_layout_dispatch(EXCLUSIVE_TWO_DEVICE_ARENAS)
+    sh_layout_dispatch(EXCLUSIVE_FOUR_DEVICE_ARENAS)
+    default:
+      break;
+  }
+
+  if(should_run_rdspy) {
+    rdspy_dispatch = dispatch;
+    dispatch.alloc = sh_alloc_rdspy;
+    dispatch.calloc = sh_calloc_rdspy;
+    dispatch.realloc = sh_realloc_rdspy;
+    dispatch.alloc_aligned = sh_alloc_aligned_rdspy;
+    dispatch.free = sh_free_rdspy;
+    dispatch.free_sized = sh_free_sized_rdspy;
+  }
+
+  if(should_count_allocations) {
+    count_dispatch = dispatch;
+    dispatch.alloc = sh_alloc_count;
+    dispatch.calloc = sh_calloc_count;
+    dispatch.realloc = sh_realloc_count;
+    dispatch.alloc_aligned = sh_alloc_aligned_count;
+    dispatch.free = sh_free_count;
+    dispatch.free_sized = sh_free_sized_count;
+  }
+
+  if(lifetime_sample_rate) {
+    lifetime_dispatch = dispatch;
+    dispatch.alloc = sh_alloc_lifetime;
+    dispatch.calloc = sh_calloc_lifetime;
+    dispatch.realloc = sh_realloc_lifetime;
+    dispatch.alloc_aligned = sh_alloc_aligned_lifetime;
+    dispatch.free = sh_free_lifetime;
+    dispatch.free_sized = sh_free_sized_lifetime;
+  }
+}
+
+void* sh_realloc(int id, void *ptr, size_t sz) {
+  return dispatch.realloc(id, ptr, sz);
+}
 
-  ptr = sh_alloc(id, sz);
-  memset(ptr, 0, num * sz);
-  return ptr;
+/* Accepts an allocation site ID and a size, does the allocation */
+void* sh_alloc(int id, size_t sz) {
+  return dispatch.alloc(id, sz);
+}
+
+/* Zeroes with MALLOCX_ZERO, so fresh pages aren't touched again */
+void* sh_calloc(int id, size_t num, size_t sz) {
+  return dispatch.calloc(id, num, sz);
 }
 
 void sh_free(void* ptr) {
-  if (should_run_rdspy) {
-      sh_rdspy_free(ptr);
+  dispatch.free(ptr);
+}
+
+/* Aligned allocation, for aligned operator new */
+void* sh_alloc_aligned(int id, size_t sz, size_t align) {
+  return dispatch.alloc_aligned(id, sz, align);
+}
+
+/* Replaces aligned_alloc and memalign */
+void* sh_aligned_alloc(int id, size_t align, size_t sz) {
+  return dispatch.alloc_aligned(id, sz, align);
+}
+
+/* Replaces posix_memalign */
+int sh_posix_memalign(int id, void **memptr, size_t align, size_t sz) {
+  void *ptr;
+
+  /* The alignment must be a power of two multiple of sizeof(void *) */
+  if(!align || (align & (align - 1)) || (align % sizeof(void *))) {
+    return EINVAL;
   }
 
-  if(layout == INVALID_LAYOUT) {
-    je_free(ptr);
-  } else {
-    sicm_free(ptr);
+  ptr = dispatch.alloc_aligned(id, sz, align);
+  if(!ptr) {
+    return ENOMEM;
   }
+  *memptr = ptr;
+  return 0;
+}
+
+/* Replaces sized operator delete */
+void sh_free_sized(void *ptr, size_t sz) {
+  dispatch.free_sized(ptr, sz, 0);
+}
+
+/* Replaces aligned operator delete */
+void sh_free_aligned(void *ptr, size_t align) {
+  dispatch.free_sized(ptr, 0, align);
+}
+
+/* Replaces sized, aligned operator delete */
+void sh_free_sized_aligned(void *ptr, size_t sz, size_t align) {
+  dispatch.free_sized(ptr, sz, align);
 }
 
 __attribute__((constructor))
@@ -738,28 +1818,27 @@ void sh_init() {
     }
   }
 
-  site_nodes = tree_make(unsigned, deviceptr);
-  device_arenas = tree_make(deviceptr, int);
+  device_arenas = (int *) calloc(device_list.count, sizeof(int));
   set_options();
   
   if(layout != INVALID_LAYOUT) {
-    /* `arenas` is a pseudo-two-dimensional array, first dimension is per-thread */
+    /* `arenas` is a sparse two-dimensional table, first dimension is per-thread */
     /* Second dimension is one for each arena that each thread will have.
-     * If the arena layout isn't per-thread (`EXCLUSIVE_`), arenas_per_thread is just
-     * the total number of arenas.
+     * If the arena layout isn't per-thread (`EXCLUSIVE_`), there's only one "thread",
+     * and arenas_per_thread is just the total number of arenas.
      */
     switch(layout) {
       case SHARED_ONE_ARENA:
       case SHARED_DEVICE_ARENAS:
       case SHARED_SITE_ARENAS:
-        arenas = (arena_info **) calloc(arenas_per_thread, sizeof(arena_info *));
+        arena_table_init(&arenas, 1, arenas_per_thread);
         break;
       case EXCLUSIVE_SITE_ARENAS:
       case EXCLUSIVE_ONE_ARENA:
       case EXCLUSIVE_DEVICE_ARENAS:
       case EXCLUSIVE_TWO_DEVICE_ARENAS:
       case EXCLUSIVE_FOUR_DEVICE_ARENAS:
-        arenas = (arena_info **) calloc(max_threads * arenas_per_thread, sizeof(arena_info *));
+        arena_table_init(&arenas, max_threads, arenas_per_thread);
         break;
     }
 
@@ -776,33 +1855,49 @@ void sh_init() {
     }
 
     /* Stores the index into the `arenas` array for each thread */
-    pthread_key_create(&thread_key, NULL);
+    pthread_key_create(&thread_key, &sh_release_thread_index);
     thread_indices = (int *) malloc(max_threads * sizeof(int));
-    orig_thread_indices = thread_indices;
-    max_thread_indices = orig_thread_indices + max_threads;
+    free_thread_indices = (int *) malloc(max_threads * sizeof(int));
     for(i = 0; i < max_threads; i++) {
       thread_indices[i] = i;
     }
+    num_free_thread_indices = 0;
     pthread_setspecific(thread_key, (void *) thread_indices);
-    thread_indices++;
+    num_thread_indices = 1;
 
-    /* Stores an index into `arenas` for the extent hooks */
-    pending_indices = (int *) calloc(max_threads, sizeof(int));
+    if(should_count_allocations) {
+      sh_counters_init(max_threads, max_sites);
+    }
+    if(lifetime_sample_rate) {
+      sh_lifetime_init(max_sites, lifetime_sample_rate, short_lifetime_us);
+    }
 
     /* Set the arena allocator's callback function */
     sicm_extent_alloc_callback = &sh_create_extent;
 
     sh_start_profile_thread();
+
+    if(guidance_reload_interval) {
+      sh_install_guidance_signal();
+      pthread_create(&guidance_reload_id, NULL, &guidance_reload_thread, NULL);
+    }
+
+    if(control_socket_path) {
+      sh_start_control_thread(control_socket_path);
+    }
   }
   
   if (should_run_rdspy) {
     sh_rdspy_init(max_threads, num_static_sites);
   }
+
+  sh_set_dispatch();
 }
 
 __attribute__((destructor))
 void sh_terminate() {
-  size_t i;
+  int index;
+  arena_info *arena;
 
   /* Clean up the low-level interface */
   sicm_fini(&device_list);
@@ -813,20 +1908,52 @@ void sh_terminate() {
     if(should_profile_all || should_profile_one || should_profile_rss) {
       sh_stop_profile_thread();
     }
+    if(should_count_allocations) {
+      sh_counters_print();
+    }
+    if(lifetime_sample_rate) {
+      sh_lifetime_print();
+    }
+
+    if(guidance_reload_interval) {
+      pthread_cancel(guidance_reload_id);
+      pthread_join(guidance_reload_id, NULL);
+    }
+
+    if(control_socket_path) {
+      sh_stop_control_thread();
+    }
 
     /* Clean up the arenas */
-    for(i = 0; i <= max_index; i++) {
-      if(!arenas[i]) continue;
-      sicm_arena_destroy(arenas[i]->arena);
-      free(arenas[i]);
+    arena_table_for(&arenas, index, arena) {
+      sicm_arena_destroy(arena->arena);
+      free(arena->node_rss);
+      free(arena->peak_node_rss);
+      free(arena);
     }
-    free(arenas);
+    arena_table_free(&arenas);
 
-    free(pending_indices);
-    free(orig_thread_indices);
+    /* No more threads can hand their index back after this */
+    pthread_key_delete(thread_key);
+    free(thread_indices);
+    free(free_thread_indices);
     extent_arr_free(extents);
+
+    if(should_count_allocations) {
+      sh_counters_terminate();
+    }
+    if(lifetime_sample_rate) {
+      sh_lifetime_terminate();
+    }
   }
 
+  free(site_placements);
+  free(online_tiers);
+  free(online_tier_caps);
+  free(site_bytes);
+  free(guided_sites);
+  free(device_arenas);
+
   if (should_run_rdspy) {
       sh_rdspy_terminate();
   }
@@ -12,6 +12,7 @@
 #include <limits.h>
 #include "sicm_high.h"
 #include "sicm_parsing.h"
+#include "sicm_guidance.h"
 #include "sicm_tree.h"
 
 union metric {
@@ -20,6 +21,7 @@ union metric {
 };
 
 use_tree(siteptr, unsigned);
+use_tree(unsigned, int);
 
 static inline int both_cmp(float a, float b) {
   int retval;
@@ -334,34 +336,98 @@ tree(unsigned, siteptr) get_thermos(tree(unsigned, siteptr) sites, size_t capaci
 	return ret;
 }
 
+/* Splits the chosen sites into SITE_NUM_CLASSES hotness classes by value per
+ * byte, with the hottest sites in the highest class. The runtime groups
+ * sites by class under SH_AGGREGATE_ARENAS.
+ */
+tree(unsigned, int) get_classes(tree(unsigned, siteptr) sites, char proftype) {
+  tree(siteptr, unsigned) sorted_sites;
+  tree(unsigned, int) ret;
+  tree_it(unsigned, siteptr) it;
+  tree_it(siteptr, unsigned) sit;
+  size_t rank, num_sites;
+
+  ret = tree_make(unsigned, int);
+  if(proftype == 0) {
+    sorted_sites = tree_make_c(siteptr, unsigned, &bandwidth_cmp);
+  } else {
+    sorted_sites = tree_make_c(siteptr, unsigned, &accesses_cmp);
+  }
+  tree_traverse(sites, it) {
+    tree_insert(sorted_sites, tree_it_val(it), tree_it_key(it));
+  }
+
+  /* Sorted from the most value per byte to the least */
+  rank = 0;
+  num_sites = tree_len(sorted_sites);
+  tree_traverse(sorted_sites, sit) {
+    tree_insert(ret, tree_it_val(sit), SITE_NUM_CLASSES - 1 - (int) ((rank * SITE_NUM_CLASSES) / num_sites));
+    rank++;
+  }
+  tree_free(sorted_sites);
+
+  return ret;
+}
+
+/* Splits a comma-separated list into its elements. Modifies `str`. */
+static char **split_list(char *str, int *num) {
+  char **ret, *tok, *save;
+
+  ret = NULL;
+  *num = 0;
+  for(tok = strtok_r(str, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    ret = realloc(ret, sizeof(char *) * (*num + 1));
+    ret[(*num)++] = tok;
+  }
+  return ret;
+}
+
 /* Reads in profiling information from stdin, then runs the packing algorithm
- * based on arguments. Prints the hotset to stdout.
+ * based on arguments. Prints the hotset to stdout. With more than one tier,
+ * the tiers are filled in order: the first tier gets the best sites, the
+ * second the best of the rest, and so on. Sites that don't make it into
+ * any tier are left off of the guidance, so they go to the default device.
  */
 int main(int argc, char **argv) {
-  char proftype, algo, captype, *endptr;
-  size_t cap_bytes, total_weight;
-  union metric total_value;
+  char proftype, algo, captype, *endptr, **cap_strs, **node_strs;
+  size_t *cap_bytes, *total_weight;
+  union metric *total_value;
   long long node;
-  float cap_float;
-  tree(unsigned, siteptr) sites, chosen_sites;
+  int *nodes, num_tiers, num_nodes, tier, weighted;
+  float *cap_float;
+  tree(unsigned, siteptr) sites, chosen_sites, tier_sites;
   tree_it(unsigned, siteptr) it;
+  tree(unsigned, int) classes, site_nodes;
+  tree_it(unsigned, int) cit, nit;
+  guidance_entry *entries;
+  uint32_t num_entries;
+  FILE *binary_file;
+  char *tmp_path;
   app_info *info;
 
   /* Read in the arguments */
-  if(argc != 6) {
-    fprintf(stderr, "USAGE: ./hotset proftype algo captype cap node\n");
-    fprintf(stderr, "proftype: mbi or pebs, the type of profiling.\n");
+  if((argc != 6) && (argc != 7)) {
+    fprintf(stderr, "USAGE: ./hotset proftype algo captype cap node [binary_file]\n");
+    fprintf(stderr, "proftype: mbi or pebs, the type of profiling. Or latency, to rank\n");
+    fprintf(stderr, "  pebs sites by the weight from SH_PROFILE_ALL_LATENCY.\n");
     fprintf(stderr, "algo: knapsack, hotset, or thermos. The packing algorithm.\n");
     fprintf(stderr, "captype: ratio or constant. The type of capacity.\n");
     fprintf(stderr, "cap: the capacity. A float 0-1 if captype is 'ratio', or a\n");
-    fprintf(stderr, "  constant number of bytes otherwise.\n");
+    fprintf(stderr, "  constant number of bytes otherwise. For more than one tier,\n");
+    fprintf(stderr, "  a comma-separated list of capacities, fastest tier first.\n");
     fprintf(stderr, "node: the node that chosen sites should be associated with.\n");
+    fprintf(stderr, "  For more than one tier, a comma-separated list of nodes,\n");
+    fprintf(stderr, "  one for each capacity.\n");
+    fprintf(stderr, "binary_file: optionally, also write the guidance to this file\n");
+    fprintf(stderr, "  in the binary format, which the runtime can map in directly.\n");
     exit(1);
   }
   if(strcmp(argv[1], "mbi") == 0) {
     proftype = 0;
   } else if(strcmp(argv[1], "pebs") == 0) {
     proftype = 1;
+  } else if(strcmp(argv[1], "latency") == 0) {
+    proftype = 2;
   } else {
     fprintf(stderr, "Proftype not recognized. Aborting.\n");
     exit(1);
@@ -376,52 +442,109 @@ int main(int argc, char **argv) {
     fprintf(stderr, "Algo not recognized. Aborting.\n");
     exit(1);
   }
+  cap_strs = split_list(argv[4], &num_tiers);
+  node_strs = split_list(argv[5], &num_nodes);
+  if(!num_tiers || (num_tiers != num_nodes)) {
+    fprintf(stderr, "There must be as many nodes as capacities. Aborting.\n");
+    exit(1);
+  }
+  cap_bytes = calloc(num_tiers, sizeof(size_t));
+  cap_float = calloc(num_tiers, sizeof(float));
+  nodes = calloc(num_tiers, sizeof(int));
   if(strcmp(argv[3], "ratio") == 0) {
     captype = 0;
-    endptr = NULL;
-    cap_float = strtof(argv[4], &endptr);
+    for(tier = 0; tier < num_tiers; tier++) {
+      endptr = NULL;
+      cap_float[tier] = strtof(cap_strs[tier], &endptr);
+    }
   } else if(strcmp(argv[3], "constant") == 0) {
     captype = 1;
-    cap_bytes = strtoimax(argv[4], &endptr, 10);
+    for(tier = 0; tier < num_tiers; tier++) {
+      cap_bytes[tier] = strtoimax(cap_strs[tier], &endptr, 10);
+    }
   } else {
     fprintf(stderr, "Captype not recognized. Aborting.\n");
     exit(1);
   }
-  endptr = NULL;
-  node = strtoimax(argv[5], &endptr, 10);
-  if(node > INT_MAX) {
-    fprintf(stderr, "The node that you specified is greater than an integer can store. Aborting.\n");
-    exit(1);
+  for(tier = 0; tier < num_tiers; tier++) {
+    endptr = NULL;
+    node = strtoimax(node_strs[tier], &endptr, 10);
+    if(node > INT_MAX) {
+      fprintf(stderr, "The node that you specified is greater than an integer can store. Aborting.\n");
+      exit(1);
+    }
+    nodes[tier] = (int) node;
   }
 
   info = sh_parse_site_info(stdin);
 
-  if(captype == 0) {
-    /* Figure out cap_bytes from the ratio */
-    cap_bytes = info->site_peak_rss * cap_float;
+  /* Latency-weighted sites are packed just like PEBS sites, by their weight.
+   * Without any weights, every site would be worth nothing.
+   */
+  if(proftype == 2) {
+    weighted = 0;
+    tree_traverse(info->sites, it) {
+      tree_it_val(it)->accesses = tree_it_val(it)->weight;
+      if(tree_it_val(it)->weight) {
+        weighted = 1;
+      }
+    }
+    if(!weighted) {
+      fprintf(stderr, "None of the sites have a weight. Profile with SH_PROFILE_ALL_LATENCY. Aborting.\n");
+      exit(1);
+    }
+    proftype = 1;
   }
 
-  /* Now run the packing algorithm */
-  if(algo == 0) {
-    chosen_sites = get_knapsack(info->sites, cap_bytes, proftype);
-  } else if(algo == 1) {
-    chosen_sites = get_hotset(info->sites, cap_bytes, proftype);
-  } else if(algo == 2) {
-    chosen_sites = get_thermos(info->sites, cap_bytes, proftype);
+  /* Now fill each tier from the sites that the faster tiers didn't take */
+  sites = tree_make(unsigned, siteptr);
+  tree_traverse(info->sites, it) {
+    /* Short-lived sites' memory is freed too soon to be worth placing */
+    if(tree_it_val(it)->short_lived) {
+      fprintf(stderr, "Leaving out short-lived site %u.\n", tree_it_key(it));
+      continue;
+    }
+    tree_insert(sites, tree_it_key(it), tree_it_val(it));
+  }
+  chosen_sites = tree_make(unsigned, siteptr);
+  site_nodes = tree_make(unsigned, int);
+  total_weight = calloc(num_tiers, sizeof(size_t));
+  total_value = calloc(num_tiers, sizeof(union metric));
+  for(tier = 0; tier < num_tiers; tier++) {
+    if(captype == 0) {
+      /* Figure out cap_bytes from the ratio */
+      cap_bytes[tier] = info->site_peak_rss * cap_float[tier];
+    }
+    if(!tree_len(sites)) continue;
+
+    if(algo == 0) {
+      tier_sites = get_knapsack(sites, cap_bytes[tier], proftype);
+    } else if(algo == 1) {
+      tier_sites = get_hotset(sites, cap_bytes[tier], proftype);
+    } else if(algo == 2) {
+      tier_sites = get_thermos(sites, cap_bytes[tier], proftype);
+    }
+
+    tree_traverse(tier_sites, it) {
+      tree_insert(chosen_sites, tree_it_key(it), tree_it_val(it));
+      tree_insert(site_nodes, tree_it_key(it), nodes[tier]);
+      tree_delete(sites, tree_it_key(it));
+      total_weight[tier] += tree_it_val(it)->peak_rss;
+      if(proftype == 0) {
+        total_value[tier].band += tree_it_val(it)->bandwidth;
+      } else {
+        total_value[tier].acc += tree_it_val(it)->accesses;
+      }
+    }
+    tree_free(tier_sites);
   }
 
+  classes = get_classes(chosen_sites, proftype);
   printf("===== GUIDANCE =====\n");
-  total_weight = 0;
-  total_value.acc = 0;
-  total_value.band = 0;
   tree_traverse(chosen_sites, it) {
-    printf("%u %d\n", tree_it_key(it), (int) node);
-    total_weight += tree_it_val(it)->peak_rss;
-    if(proftype == 0) { 
-      total_value.band += tree_it_val(it)->bandwidth;
-    } else {
-      total_value.acc += tree_it_val(it)->accesses;
-    }
+    cit = tree_lookup(classes, tree_it_key(it));
+    nit = tree_lookup(site_nodes, tree_it_key(it));
+    printf("%u %d %d\n", tree_it_key(it), tree_it_val(nit), tree_it_val(cit));
   }
   printf("===== END GUIDANCE =====\n");
   if(algo == 0) {
@@ -431,23 +554,73 @@ int main(int argc, char **argv) {
   } else if(algo == 2) {
     printf("Strategy: Thermos\n");
   }
-  printf("Used capacity: %zu bytes\n", total_weight);
-  if(proftype == 0) {
-    printf("Total value: %f\n", total_value.band);
-  } else {
-    printf("Total value: %zu\n", total_value.acc);
-  }
-  printf("Capacity: %zu bytes\n", cap_bytes);
-  if(captype == 0) {
-    printf("Capacity Ratio: %f\n", cap_float);
+  for(tier = 0; tier < num_tiers; tier++) {
+    printf("Tier %d: NUMA node %d\n", tier, nodes[tier]);
+    printf("Used capacity: %zu bytes\n", total_weight[tier]);
+    if(proftype == 0) {
+      printf("Total value: %f\n", total_value[tier].band);
+    } else {
+      printf("Total value: %zu\n", total_value[tier].acc);
+    }
+    printf("Capacity: %zu bytes\n", cap_bytes[tier]);
+    if(captype == 0) {
+      printf("Capacity Ratio: %f\n", cap_float[tier]);
+    }
   }
   printf("Peak RSS: %zu bytes\n", info->site_peak_rss);
 
+  /* Write the binary guidance. A running application may be rereading the
+   * file, so write a new one and rename it over the old one.
+   */
+  if(argc == 7) {
+    tmp_path = (char *) malloc(strlen(argv[6]) + 5);
+    sprintf(tmp_path, "%s.tmp", argv[6]);
+    binary_file = fopen(tmp_path, "w");
+    if(!binary_file) {
+      fprintf(stderr, "Failed to open %s. Aborting.\n", tmp_path);
+      exit(1);
+    }
+    entries = (guidance_entry *) calloc(tree_len(chosen_sites), sizeof(guidance_entry));
+    num_entries = 0;
+    tree_traverse(chosen_sites, it) {
+      cit = tree_lookup(classes, tree_it_key(it));
+      nit = tree_lookup(site_nodes, tree_it_key(it));
+      entries[num_entries].site = tree_it_key(it);
+      entries[num_entries].node = (int16_t) tree_it_val(nit);
+      entries[num_entries].hotness = (uint16_t) tree_it_val(cit);
+      num_entries++;
+    }
+    if(sh_write_guidance(binary_file, entries, num_entries) != 0) {
+      fprintf(stderr, "Failed to write %s. Aborting.\n", argv[6]);
+      exit(1);
+    }
+    if(fclose(binary_file) != 0) {
+      fprintf(stderr, "Failed to write %s. Aborting.\n", tmp_path);
+      exit(1);
+    }
+    if(rename(tmp_path, argv[6]) != 0) {
+      fprintf(stderr, "Failed to rename %s to %s. Aborting.\n", tmp_path, argv[6]);
+      exit(1);
+    }
+    free(tmp_path);
+    free(entries);
+  }
+
   /* Clean up */
+  tree_free(classes);
+  tree_free(site_nodes);
   tree_traverse(info->sites, it) {
     free(tree_it_val(it));
   }
 	tree_free(info->sites);
   free(info);
+  tree_free(sites);
   tree_free(chosen_sites);
+  free(cap_strs);
+  free(node_strs);
+  free(cap_bytes);
+  free(cap_float);
+  free(nodes);
+  free(total_weight);
+  free(total_value);
 }
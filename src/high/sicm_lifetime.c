@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sicm_lifetime.h"
+
+#define LIFETIME_NUM_BUCKETS (1 << LIFETIME_BUCKET_SHIFT)
+#define LIFETIME_NUM_SLOTS   (LIFETIME_NUM_BUCKETS * LIFETIME_BUCKET_SLOTS)
+
+/* Slot keys that aren't pointers. A slot is BUSY while its owner fills it
+ * in or empties it, so nobody reads half of a sample.
+ */
+#define SLOT_EMPTY ((uintptr_t) 0)
+#define SLOT_BUSY  ((uintptr_t) 1)
+
+typedef struct lifetime_sample {
+  uint64_t birth; /* Nanoseconds */
+  uint32_t site;
+} lifetime_sample;
+
+typedef struct lifetime_hist {
+  size_t sampled, freed, short_lived;
+  size_t bins[LIFETIME_NUM_BINS];
+} lifetime_hist;
+
+static uintptr_t *keys;
+static lifetime_sample *samples;
+static lifetime_hist *hists;
+static int num_sites;
+static long sample_rate;
+static uint64_t short_lifetime;
+static size_t dropped;
+static __thread long countdown;
+
+static inline uint64_t lifetime_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* jemalloc's pointers are at least 16-byte aligned, so skip those bits */
+static inline size_t lifetime_bucket(void *ptr) {
+  uint64_t key;
+
+  key = ((uintptr_t) ptr >> 4) * 0x9E3779B97F4A7C15ULL;
+  return (key >> (64 - LIFETIME_BUCKET_SHIFT)) * LIFETIME_BUCKET_SLOTS;
+}
+
+void sh_lifetime_init(int max_sites, long rate, long short_lifetime_us) {
+  num_sites = max_sites;
+  sample_rate = (rate > 0) ? rate : 1;
+  short_lifetime = (uint64_t) short_lifetime_us * 1000;
+  keys = (uintptr_t *) aligned_alloc(64, LIFETIME_NUM_SLOTS * sizeof(uintptr_t));
+  memset(keys, 0, LIFETIME_NUM_SLOTS * sizeof(uintptr_t));
+  samples = (lifetime_sample *) calloc(LIFETIME_NUM_SLOTS, sizeof(lifetime_sample));
+  hists = (lifetime_hist *) calloc(num_sites, sizeof(lifetime_hist));
+}
+
+/* Puts a sample in the side table. Returns 0 if its bucket is full. */
+static int lifetime_insert(void *ptr, uint32_t site, uint64_t birth) {
+  uintptr_t expected;
+  size_t slot, i;
+
+  slot = lifetime_bucket(ptr);
+  for(i = 0; i < LIFETIME_BUCKET_SLOTS; i++, slot++) {
+    expected = SLOT_EMPTY;
+    if(__atomic_compare_exchange_n(&keys[slot], &expected, SLOT_BUSY,
+                                   0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      samples[slot].birth = birth;
+      samples[slot].site = site;
+      __atomic_store_n(&keys[slot], (uintptr_t) ptr, __ATOMIC_RELEASE);
+      return 1;
+    }
+  }
+  __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Samples one in every `sample_rate` allocations on this thread */
+void sh_lifetime_alloc(int id, void *ptr) {
+  if(!ptr || (id < 0) || (id >= num_sites)) {
+    return;
+  }
+  if(--countdown > 0) {
+    return;
+  }
+  countdown = sample_rate;
+
+  if(lifetime_insert(ptr, id, lifetime_now())) {
+    __atomic_fetch_add(&hists[id].sampled, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* Takes a pointer's sample out of the side table, if it has one.
+ * Returns 1 if it did.
+ */
+int sh_lifetime_remove(void *ptr, uint32_t *site, uint64_t *birth) {
+  uintptr_t expected;
+  size_t slot, i;
+
+  if(!ptr) {
+    return 0;
+  }
+  slot = lifetime_bucket(ptr);
+  for(i = 0; i < LIFETIME_BUCKET_SLOTS; i++, slot++) {
+    if(__atomic_load_n(&keys[slot], __ATOMIC_RELAXED) != (uintptr_t) ptr) continue;
+    expected = (uintptr_t) ptr;
+    if(__atomic_compare_exchange_n(&keys[slot], &expected, SLOT_BUSY,
+                                   0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      *birth = samples[slot].birth;
+      *site = samples[slot].site;
+      __atomic_store_n(&keys[slot], SLOT_EMPTY, __ATOMIC_RELEASE);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Puts back a sample that was taken out for a realloc, under the pointer
+ * that the object lives at now. The object is still the same one, so it
+ * keeps its allocation time.
+ */
+void sh_lifetime_move(void *ptr, uint32_t site, uint64_t birth) {
+  if(!lifetime_insert(ptr, site, birth)) {
+    __atomic_fetch_sub(&hists[site].sampled, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* Records the lifetime of a freed pointer, if it was sampled */
+void sh_lifetime_free(void *ptr) {
+  uint64_t birth, lifetime, limit;
+  uint32_t site;
+  int bin;
+
+  if(!sh_lifetime_remove(ptr, &site, &birth)) {
+    return;
+  }
+  lifetime = lifetime_now() - birth;
+  for(bin = 0, limit = 1000; (bin < LIFETIME_NUM_BINS - 1) && (lifetime >= limit); bin++) {
+    limit *= 10;
+  }
+  __atomic_fetch_add(&hists[site].bins[bin], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hists[site].freed, 1, __ATOMIC_RELAXED);
+  if(lifetime < short_lifetime) {
+    __atomic_fetch_add(&hists[site].short_lived, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* Whether most of a site's sampled objects, live or not, died young.
+ * Online profiling leaves these sites on the default device, since
+ * their memory would be freed before moving it could pay off.
+ */
+int sh_site_is_short_lived(int id) {
+  size_t sampled, short_lived;
+
+  if(!hists || (id < 0) || (id >= num_sites)) {
+    return 0;
+  }
+  sampled = __atomic_load_n(&hists[id].sampled, __ATOMIC_RELAXED);
+  short_lived = __atomic_load_n(&hists[id].short_lived, __ATOMIC_RELAXED);
+  return (sampled >= LIFETIME_MIN_SAMPLES) && (short_lived * 2 >= sampled);
+}
+
+static const char *lifetime_class_str(lifetime_hist *hist, size_t live) {
+  if(!hist->sampled) {
+    return "unknown";
+  } else if(live * 2 >= hist->sampled) {
+    return "permanent";
+  } else if(hist->short_lived * 2 >= hist->sampled) {
+    return "short";
+  }
+  return "phase";
+}
+
+void sh_lifetime_print() {
+  const char *bin_strs[LIFETIME_NUM_BINS] = {
+    "<1us", "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", "<10s", ">=10s"
+  };
+  lifetime_hist *hist;
+  size_t *live, slot;
+  uintptr_t key;
+  int id, bin;
+
+  /* Whatever's still in the side table was never freed */
+  live = (size_t *) calloc(num_sites, sizeof(size_t));
+  for(slot = 0; slot < LIFETIME_NUM_SLOTS; slot++) {
+    key = __atomic_load_n(&keys[slot], __ATOMIC_ACQUIRE);
+    if((key == SLOT_EMPTY) || (key == SLOT_BUSY)) continue;
+    live[samples[slot].site]++;
+  }
+
+  printf("===== LIFETIME RESULTS =====\n");
+  for(id = 0; id < num_sites; id++) {
+    hist = &hists[id];
+    if(!hist->sampled) continue;
+    printf("Site %d:\n", id);
+    printf("  Sampled: %zu\n", hist->sampled);
+    printf("  Lifetimes:");
+    for(bin = 0; bin < LIFETIME_NUM_BINS; bin++) {
+      if(hist->bins[bin]) {
+        printf(" %s:%zu", bin_strs[bin], hist->bins[bin]);
+      }
+    }
+    printf(" live:%zu\n", live[id]);
+    printf("  Lifetime: %s\n", lifetime_class_str(hist, live[id]));
+  }
+  printf("Dropped: %zu\n", dropped);
+  printf("===== END LIFETIME RESULTS =====\n");
+  free(live);
+}
+
+void sh_lifetime_terminate() {
+  free(keys);
+  free(samples);
+  free(hists);
+  keys = NULL;
+  samples = NULL;
+  hists = NULL;
+}
@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/userfaultfd.h>
+
+#include "sicm_high.h"
+#include "sicm_pagescan.h"
+
+/* From the kernel's headers, for systems whose headers are older than it */
+#ifndef PAGEMAP_SCAN
+#define PAGE_IS_WPALLOWED (1 << 0)
+#define PAGE_IS_WRITTEN   (1 << 1)
+#define PAGE_IS_FILE      (1 << 2)
+#define PAGE_IS_PRESENT   (1 << 3)
+
+struct page_region {
+  uint64_t start, end, categories;
+};
+
+#define PM_SCAN_WP_MATCHING   (1 << 0)
+#define PM_SCAN_CHECK_WPASYNC (1 << 1)
+
+struct pm_scan_arg {
+  uint64_t size, flags, start, end, walk_end, vec, vec_len, max_pages;
+  uint64_t category_inverted, category_mask, category_anyof_mask, return_mask;
+};
+
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#endif
+
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_ASYNC (1 << 15)
+#endif
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1
+#endif
+
+#define PAGEMAP_PRESENT    (1ULL << 63)
+#define PAGEMAP_SOFT_DIRTY (1ULL << 55)
+#define PAGESCAN_REGIONS   512 /* Regions per PAGEMAP_SCAN call */
+
+/* A copy of an extent, so that the scan doesn't need to hold `extents_lock` */
+typedef struct scan_extent {
+  uint64_t start, end;
+  arena_info *arena;
+  char registered; /* Registered with the userfaultfd, so PAGEMAP_SCAN sees its writes */
+} scan_extent;
+
+static int pagemap_fd = -1, uffd = -1;
+static int soft_dirty; /* Whether we fell back to soft-dirty bits */
+static int soft_dirty_ok; /* Whether they work, for extents that can't be registered */
+static size_t pagesize, scan_version;
+static struct page_region *regions;
+static uint64_t *entries;
+static size_t max_entries;
+
+/* The copy of `extents`, only updated when `extents_version` changes */
+static scan_extent *scan_arr;
+static size_t num_scan, max_scan;
+
+/* Scans [start, end) for written and present pages with PAGEMAP_SCAN,
+ * write-protecting them again. Returns -1 if the scan fails.
+ */
+static int scan_range(uint64_t start, uint64_t end, size_t *written, size_t *present) {
+  struct pm_scan_arg arg;
+  size_t pages;
+  long n, i;
+
+  memset(&arg, 0, sizeof(struct pm_scan_arg));
+  arg.size = sizeof(struct pm_scan_arg);
+  arg.flags = PM_SCAN_WP_MATCHING;
+  arg.start = start;
+  arg.end = end;
+  arg.vec = (uintptr_t) regions;
+  arg.vec_len = PAGESCAN_REGIONS;
+  arg.category_anyof_mask = PAGE_IS_WRITTEN | PAGE_IS_PRESENT;
+  arg.return_mask = PAGE_IS_WRITTEN | PAGE_IS_PRESENT;
+
+  /* One call per extent, unless it has more than PAGESCAN_REGIONS runs of pages */
+  while(1) {
+    n = ioctl(pagemap_fd, PAGEMAP_SCAN, &arg);
+    if(n < 0) {
+      return -1;
+    }
+    for(i = 0; i < n; i++) {
+      pages = (regions[i].end - regions[i].start) / pagesize;
+      /* Pages that aren't there yet, or weren't when their extent was
+       * registered, have no write-protect marker, so they look written
+       */
+      if((regions[i].categories & PAGE_IS_WRITTEN) && (regions[i].categories & PAGE_IS_PRESENT)) {
+        *written += pages;
+      }
+      if(regions[i].categories & PAGE_IS_PRESENT) {
+        *present += pages;
+      }
+    }
+    if(arg.walk_end >= end) break;
+    arg.start = arg.walk_end;
+  }
+  return 0;
+}
+
+/* Reads the pagemap entries of [start, end), and counts the soft-dirty and present ones */
+static int read_range(uint64_t start, uint64_t end, size_t *written, size_t *present) {
+  size_t num, i;
+
+  num = (end - start) / pagesize;
+  if(num > max_entries) {
+    max_entries = num;
+    entries = realloc(entries, max_entries * sizeof(uint64_t));
+  }
+  if(pread(pagemap_fd, entries, num * sizeof(uint64_t), (start / pagesize) * sizeof(uint64_t)) != num * sizeof(uint64_t)) {
+    return -1;
+  }
+  for(i = 0; i < num; i++) {
+    if(entries[i] & PAGEMAP_SOFT_DIRTY) {
+      (*written)++;
+    }
+    if(entries[i] & PAGEMAP_PRESENT) {
+      (*present)++;
+    }
+  }
+  return 0;
+}
+
+/* Resets every soft-dirty bit in the process */
+static void clear_soft_dirty() {
+  int fd;
+
+  fd = open("/proc/self/clear_refs", O_WRONLY);
+  if((fd == -1) || (write(fd, "4", 1) != 1)) {
+    fprintf(stderr, "Failed to clear soft-dirty bits. Aborting.\n");
+    exit(1);
+  }
+  close(fd);
+}
+
+/* Whether the kernel sets soft-dirty bits. Without CONFIG_MEM_SOFT_DIRTY,
+ * clearing them succeeds, but they're never set.
+ */
+static int soft_dirty_works() {
+  size_t written, present;
+  char *page;
+  int ret;
+
+  page = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(page == MAP_FAILED) {
+    return 0;
+  }
+  page[0] = 1;
+  written = 0;
+  present = 0;
+  ret = (read_range((uintptr_t) page, (uintptr_t) page + pagesize, &written, &present) == 0) && written;
+  munmap(page, pagesize);
+  return ret;
+}
+
+static int uffd_register(void *start, size_t len) {
+  struct uffdio_register reg;
+
+  memset(&reg, 0, sizeof(struct uffdio_register));
+  reg.range.start = (uintptr_t) start;
+  reg.range.len = len;
+  reg.mode = UFFDIO_REGISTER_MODE_WP;
+  return ioctl(uffd, UFFDIO_REGISTER, &reg);
+}
+
+/* Sets up an asynchronous write-protecting userfaultfd, and makes sure that
+ * PAGEMAP_SCAN works with it on a page of our own. Returns 0 on success.
+ */
+static int uffd_init() {
+  struct uffdio_api api;
+  size_t written, present;
+  char *page;
+  int ret;
+
+  uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+  if(uffd == -1) {
+    /* Kernels before 5.11 don't know UFFD_USER_MODE_ONLY */
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  }
+  if(uffd == -1) {
+    return -1;
+  }
+  memset(&api, 0, sizeof(struct uffdio_api));
+  api.api = UFFD_API;
+  api.features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED;
+  if(ioctl(uffd, UFFDIO_API, &api) == -1) {
+    close(uffd);
+    uffd = -1;
+    return -1;
+  }
+
+  page = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(page == MAP_FAILED) {
+    close(uffd);
+    uffd = -1;
+    return -1;
+  }
+  written = 0;
+  present = 0;
+  ret = uffd_register(page, pagesize);
+  if(ret == 0) {
+    ret = scan_range((uintptr_t) page, (uintptr_t) page + pagesize, &written, &present);
+  }
+  munmap(page, pagesize);
+  if(ret != 0) {
+    close(uffd);
+    uffd = -1;
+  }
+  return ret;
+}
+
+/* Copies any new extents out of `extents`, and registers them with the
+ * userfaultfd. Extents aren't removed, so the ones that we have stay valid.
+ * PAGEMAP_SCAN skips the pages of extents that can't be registered, like
+ * file-backed ones, so those are read from the pagemap instead.
+ */
+static void sync_extents() {
+  scan_extent *e;
+  size_t i, first;
+
+  pthread_rwlock_rdlock(&extents_lock);
+  if(scan_arr && (scan_version == extents_version)) {
+    pthread_rwlock_unlock(&extents_lock);
+    return;
+  }
+  if(extents->index > max_scan) {
+    max_scan = extents->index * 2;
+    scan_arr = (scan_extent *) realloc(scan_arr, max_scan * sizeof(scan_extent));
+  }
+  first = extents->index;
+  extent_arr_for(extents, i) {
+    e = &scan_arr[i];
+    if((i < num_scan) &&
+       (e->start == (uint64_t) extents->arr[i].start) &&
+       (e->end == (uint64_t) extents->arr[i].end)) {
+      continue;
+    }
+    e->start = (uint64_t) extents->arr[i].start;
+    e->end = (uint64_t) extents->arr[i].end;
+    e->arena = (arena_info *) extents->arr[i].arena;
+    e->registered = 0;
+    if(i < first) {
+      first = i;
+    }
+  }
+  num_scan = extents->index;
+  scan_version = extents_version;
+  pthread_rwlock_unlock(&extents_lock);
+
+  if(soft_dirty) return;
+  for(i = first; i < num_scan; i++) {
+    e = &scan_arr[i];
+    if((!e->start && !e->end) || e->registered) continue;
+    if(uffd_register((void *) e->start, e->end - e->start) == 0) {
+      e->registered = 1;
+    } else {
+      fprintf(stderr, "Failed to register an extent with userfaultfd: %s. %s\n", strerror(errno),
+              soft_dirty_ok ? "Using soft-dirty bits for it." : "Its writes won't be counted.");
+    }
+  }
+}
+
+void sh_pagescan_init() {
+  pagesize = (size_t) sysconf(_SC_PAGESIZE);
+  regions = (struct page_region *) malloc(PAGESCAN_REGIONS * sizeof(struct page_region));
+  entries = NULL;
+  max_entries = 0;
+  scan_arr = NULL;
+  num_scan = 0;
+  max_scan = 0;
+  scan_version = 0;
+
+  pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+  if(pagemap_fd == -1) {
+    fprintf(stderr, "Failed to open /proc/self/pagemap. Aborting.\n");
+    exit(1);
+  }
+
+  soft_dirty = 0;
+  soft_dirty_ok = soft_dirty_works();
+  if(uffd_init() != 0) {
+    if(!soft_dirty_ok) {
+      fprintf(stderr, "Neither PAGEMAP_SCAN nor soft-dirty bits are available. Aborting.\n");
+      exit(1);
+    }
+    printf("PAGEMAP_SCAN with userfaultfd isn't available. Using soft-dirty bits.\n");
+    soft_dirty = 1;
+    clear_soft_dirty();
+  } else {
+    printf("Tracking written pages with PAGEMAP_SCAN.\n");
+  }
+}
+
+/* Adds the pages that each extent has written since the last interval to its
+ * arena's accesses, and sets each arena's RSS.
+ */
+void sh_pagescan_interval() {
+  size_t i, written, present;
+  arena_info *arena;
+  scan_extent *e;
+  int index, err, read_any;
+
+  sync_extents();
+
+  for(i = 0; i < num_scan; i++) {
+    arena = scan_arr[i].arena;
+    if(!arena) continue;
+    arena->rss = 0;
+  }
+  read_any = 0;
+  for(i = 0; i < num_scan; i++) {
+    e = &scan_arr[i];
+    if(!e->start && !e->end) continue;
+    arena = e->arena;
+    if(!arena) continue;
+    written = 0;
+    present = 0;
+    if(e->registered) {
+      err = scan_range(e->start, e->end, &written, &present);
+    } else {
+      err = read_range(e->start, e->end, &written, &present);
+      read_any = 1;
+      if(!soft_dirty_ok) {
+        written = 0;
+      }
+    }
+    if(err) {
+      fprintf(stderr, "Failed to scan the pages of an extent: %s. Aborting.\n", strerror(errno));
+      exit(1);
+    }
+    arena->accesses += written;
+    arena->interval_accesses += written;
+    arena->writes += written;
+    arena->interval_writes += written;
+    arena->rss += present * pagesize;
+  }
+  arena_table_for(&arenas, index, arena) {
+    if(arena->rss > arena->peak_rss) {
+      arena->peak_rss = arena->rss;
+    }
+  }
+
+  if(read_any && soft_dirty_ok) {
+    clear_soft_dirty();
+  }
+}
+
+void sh_pagescan_terminate() {
+  close(pagemap_fd);
+  if(uffd != -1) {
+    close(uffd);
+  }
+  free(regions);
+  free(entries);
+  free(scan_arr);
+}
@@ -0,0 +1,460 @@
+/* libsicm_preload.so: runs uninstrumented binaries on the high-level
+ * interface. LD_PRELOAD it, and it replaces malloc and friends and the
+ * operator new and delete variants with the sh_* entry points, using a hash
+ * of the caller's return addresses as the site ID. Profiling and guidance
+ * then work the same as with a binary that compass transformed.
+ *
+ * The return addresses come from walking frame pointers, so binaries built
+ * without them give shallower, but still usable, stacks. Walks are cached by
+ * the raw addresses. On a miss, the addresses are made relative to their
+ * shared objects with dladdr, so that a stack gets the same site ID from run
+ * to run in spite of ASLR. Site IDs are that hash, modulo the number of
+ * sites that the runtime has room for, so unrelated stacks can share one.
+ *
+ * Options:
+ *   SH_PRELOAD_DEPTH       How many return addresses to hash (default 4, at most 16)
+ *   SH_PRELOAD_SITES_FILE  Writes each stack's site ID and addresses to this file
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <jemalloc/jemalloc.h>
+
+#include "sicm_high.h"
+
+#define PRELOAD_MAX_DEPTH     16
+#define PRELOAD_CACHE_SHIFT   16
+#define PRELOAD_CACHE_SIZE    (1 << PRELOAD_CACHE_SHIFT)
+#define PRELOAD_CACHE_PROBES  8
+#define PRELOAD_MAX_FRAME     (1 << 20) /* Bigger than any sane stack frame */
+
+#define PRELOAD_TLS __thread __attribute__((tls_model("initial-exec")))
+
+/* Raw stack hash -> site ID. A slot's key is claimed with a CAS, and a reader
+ * that sees the key before the site is written just takes the slow path.
+ */
+typedef struct preload_cache_entry {
+  uint64_t key;
+  int site;
+} preload_cache_entry;
+
+static preload_cache_entry *cache;
+static int depth = 4;
+static FILE *sites_file;
+static pthread_mutex_t sites_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set while this thread is inside the runtime or the site lookup. The runtime
+ * calls malloc itself, and those calls go straight to jemalloc instead of
+ * coming back around.
+ */
+static PRELOAD_TLS int in_sicm;
+
+/* The runtime's own threads, which always just use jemalloc */
+extern PRELOAD_TLS int sh_internal_thread;
+
+/* The top of this thread's stack, so that a bogus frame pointer in code
+ * built without them doesn't send the walk off into unmapped memory.
+ * pthread_getattr_np would take a lock that the thread might already hold,
+ * so this uses where glibc puts things instead: a thread's descriptor sits
+ * at the top of its stack, and the main thread's stack ends at
+ * __libc_stack_end.
+ */
+extern void *__libc_stack_end;
+static PRELOAD_TLS char *stack_hi;
+
+static void get_stack_top(void *sp) {
+  char *self;
+
+  self = (char *) pthread_self();
+  if(self > (char *) sp) {
+    stack_hi = self;
+  } else {
+    stack_hi = (char *) __libc_stack_end;
+  }
+}
+
+/* Fills `addrs` with up to `depth` return addresses, starting with the caller
+ * of the interposed function, whose frame is `fp`. Returns how many it found.
+ */
+static inline __attribute__((always_inline))
+int walk_stack(void **fp, void **addrs) {
+  void **next;
+  int n;
+
+  if(!stack_hi) {
+    get_stack_top(fp);
+  }
+
+  /* The interposed function's own frame is always good */
+  addrs[0] = fp[1];
+  n = 1;
+  next = (void **) fp[0];
+  while(n < depth) {
+    /* Frames go up the stack, aren't absurdly big, and stay on the stack */
+    if((next <= fp) || ((uintptr_t) next - (uintptr_t) fp > PRELOAD_MAX_FRAME) ||
+       ((uintptr_t) next & (sizeof(void *) - 1)) ||
+       ((uintptr_t) next > (uintptr_t) stack_hi - (2 * sizeof(void *)))) {
+      break;
+    }
+    fp = next;
+    addrs[n++] = fp[1];
+    next = (void **) fp[0];
+  }
+  return n;
+}
+
+static inline uint64_t hash_combine(uint64_t hash, uint64_t val) {
+  return (hash ^ val) * 0x100000001B3ULL;
+}
+
+/* Hashes the stack the slow way, so that it's the same from run to run,
+ * and turns that into a site ID
+ */
+static int stable_site(void **addrs, int n) {
+  Dl_info info;
+  uint64_t hash;
+  const char *name;
+  int i;
+
+  hash = 0xCBF29CE484222325ULL;
+  for(i = 0; i < n; i++) {
+    if(dladdr(addrs[i], &info) && info.dli_fname) {
+      name = strrchr(info.dli_fname, '/');
+      name = name ? name + 1 : info.dli_fname;
+      while(*name) {
+        hash = hash_combine(hash, (unsigned char) *name++);
+      }
+      hash = hash_combine(hash, (uintptr_t) addrs[i] - (uintptr_t) info.dli_fbase);
+    } else {
+      hash = hash_combine(hash, (uintptr_t) addrs[i]);
+    }
+  }
+
+  /* Site IDs start at 1, after the pool's */
+  return 1 + (int) (hash % (uint64_t) (max_sites - 1));
+}
+
+static void write_site(int site, void **addrs, int n) {
+  Dl_info info;
+  int i;
+
+  pthread_mutex_lock(&sites_file_lock);
+  fprintf(sites_file, "%d", site);
+  for(i = 0; i < n; i++) {
+    if(dladdr(addrs[i], &info) && info.dli_fname) {
+      fprintf(sites_file, " %s+0x%lx", info.dli_fname,
+              (unsigned long) ((uintptr_t) addrs[i] - (uintptr_t) info.dli_fbase));
+    } else {
+      fprintf(sites_file, " %p", addrs[i]);
+    }
+  }
+  fprintf(sites_file, "\n");
+  fflush(sites_file);
+  pthread_mutex_unlock(&sites_file_lock);
+}
+
+/* Gets the site ID of the stack that `fp` is the frame of. The cache must exist. */
+static inline __attribute__((always_inline))
+int get_site(void **fp) {
+  void *addrs[PRELOAD_MAX_DEPTH];
+  uint64_t hash, expected;
+  size_t slot;
+  int n, i, site;
+
+  n = walk_stack(fp, addrs);
+  hash = 0xCBF29CE484222325ULL;
+  for(i = 0; i < n; i++) {
+    hash = hash_combine(hash, (uintptr_t) addrs[i]);
+  }
+  if(!hash) {
+    hash = 1;
+  }
+
+  slot = (hash * 0x9E3779B97F4A7C15ULL) >> (64 - PRELOAD_CACHE_SHIFT);
+  for(i = 0; i < PRELOAD_CACHE_PROBES; i++) {
+    if(__atomic_load_n(&cache[(slot + i) & (PRELOAD_CACHE_SIZE - 1)].key, __ATOMIC_ACQUIRE) == hash) {
+      site = __atomic_load_n(&cache[(slot + i) & (PRELOAD_CACHE_SIZE - 1)].site, __ATOMIC_ACQUIRE);
+      if(site) {
+        return site;
+      }
+      break;
+    }
+  }
+
+  /* Not cached yet */
+  site = stable_site(addrs, n);
+  for(i = 0; i < PRELOAD_CACHE_PROBES; i++) {
+    expected = 0;
+    if(__atomic_compare_exchange_n(&cache[(slot + i) & (PRELOAD_CACHE_SIZE - 1)].key, &expected, hash,
+                                   0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&cache[(slot + i) & (PRELOAD_CACHE_SIZE - 1)].site, site, __ATOMIC_RELEASE);
+      if(sites_file) {
+        write_site(site, addrs, n);
+      }
+      break;
+    }
+    if(expected == hash) break;
+  }
+  return site;
+}
+
+/* Runs once the runtime is initialized, since libsicm_high is a dependency */
+__attribute__((constructor))
+static void sh_preload_init() {
+  char *env;
+
+  in_sicm = 1;
+  env = getenv("SH_PRELOAD_DEPTH");
+  if(env) {
+    depth = strtol(env, NULL, 10);
+    if(depth < 1) {
+      depth = 1;
+    } else if(depth > PRELOAD_MAX_DEPTH) {
+      depth = PRELOAD_MAX_DEPTH;
+    }
+  }
+  env = getenv("SH_PRELOAD_SITES_FILE");
+  if(env) {
+    sites_file = fopen(env, "w");
+    if(!sites_file) {
+      fprintf(stderr, "Failed to open %s. Aborting.\n", env);
+      exit(1);
+    }
+  }
+  /* Without room for sites, everything just goes to jemalloc */
+  if(max_sites >= 2) {
+    cache = (preload_cache_entry *) je_calloc(PRELOAD_CACHE_SIZE, sizeof(preload_cache_entry));
+  }
+  in_sicm = 0;
+}
+
+__attribute__((destructor))
+static void sh_preload_terminate() {
+  if(sites_file) {
+    in_sicm = 1;
+    fclose(sites_file);
+    sites_file = NULL;
+    in_sicm = 0;
+  }
+}
+
+/* Each replacement takes the site of its own frame, then calls into the
+ * runtime with the guard set. Inside the runtime, on its own threads, and
+ * before this library is initialized, it's just jemalloc.
+ */
+#define preload_enter(FALLBACK) \
+  int site; \
+  if(in_sicm || sh_internal_thread || !cache) { \
+    return FALLBACK; \
+  } \
+  in_sicm = 1; \
+  site = get_site((void **) __builtin_frame_address(0));
+
+#define preload_leave(RET) \
+  in_sicm = 0; \
+  return RET;
+
+void *malloc(size_t sz) {
+  void *ret;
+  preload_enter(je_malloc(sz))
+  ret = sh_alloc(site, sz);
+  preload_leave(ret)
+}
+
+void *calloc(size_t num, size_t sz) {
+  void *ret;
+  preload_enter(je_calloc(num, sz))
+  ret = sh_calloc(site, num, sz);
+  preload_leave(ret)
+}
+
+void *realloc(void *ptr, size_t sz) {
+  void *ret;
+  if(ptr && !sz) {
+    free(ptr);
+    return NULL;
+  }
+  preload_enter(je_realloc(ptr, sz))
+  ret = sh_realloc(site, ptr, sz);
+  preload_leave(ret)
+}
+
+void *reallocarray(void *ptr, size_t num, size_t sz) {
+  size_t total;
+
+  if(__builtin_mul_overflow(num, sz, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(ptr, total);
+}
+
+void free(void *ptr) {
+  if(in_sicm || sh_internal_thread) {
+    je_free(ptr);
+    return;
+  }
+  in_sicm = 1;
+  sh_free(ptr);
+  in_sicm = 0;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t sz) {
+  int ret;
+  preload_enter(je_posix_memalign(memptr, align, sz))
+  ret = sh_posix_memalign(site, memptr, align, sz);
+  preload_leave(ret)
+}
+
+void *aligned_alloc(size_t align, size_t sz) {
+  void *ret;
+  preload_enter(je_aligned_alloc(align, sz))
+  ret = sh_aligned_alloc(site, align, sz);
+  preload_leave(ret)
+}
+
+void *memalign(size_t align, size_t sz) {
+  void *ret;
+  preload_enter(je_aligned_alloc(align, sz))
+  ret = sh_aligned_alloc(site, align, sz);
+  preload_leave(ret)
+}
+
+void *valloc(size_t sz) {
+  void *ret;
+  preload_enter(je_aligned_alloc(4096, sz))
+  ret = sh_aligned_alloc(site, 4096, sz);
+  preload_leave(ret)
+}
+
+/* glibc's doesn't know about jemalloc's pointers */
+size_t malloc_usable_size(void *ptr) {
+  return ptr ? je_malloc_usable_size(ptr) : 0;
+}
+
+/* operator new and delete. This is a C library, so a failed operator new
+ * can't throw std::bad_alloc; it aborts instead, which is what an uncaught
+ * bad_alloc would have done anyway.
+ */
+static void *new_or_abort(void *ptr, size_t sz) {
+  if(!ptr) {
+    fprintf(stderr, "operator new failed to allocate %zu bytes. Aborting.\n", sz);
+    abort();
+  }
+  return ptr;
+}
+
+void *_Znwm(size_t sz) {
+  void *ret;
+  preload_enter(new_or_abort(je_malloc(sz), sz))
+  ret = sh_alloc(site, sz);
+  in_sicm = 0;
+  return new_or_abort(ret, sz);
+}
+
+void *_Znam(size_t sz) {
+  void *ret;
+  preload_enter(new_or_abort(je_malloc(sz), sz))
+  ret = sh_alloc(site, sz);
+  in_sicm = 0;
+  return new_or_abort(ret, sz);
+}
+
+void *_ZnwmRKSt9nothrow_t(size_t sz, const void *nothrow) {
+  void *ret;
+  preload_enter(je_malloc(sz))
+  ret = sh_alloc(site, sz);
+  preload_leave(ret)
+}
+
+void *_ZnamRKSt9nothrow_t(size_t sz, const void *nothrow) {
+  void *ret;
+  preload_enter(je_malloc(sz))
+  ret = sh_alloc(site, sz);
+  preload_leave(ret)
+}
+
+void *_ZnwmSt11align_val_t(size_t sz, size_t align) {
+  void *ret;
+  preload_enter(new_or_abort(je_aligned_alloc(align, sz), sz))
+  ret = sh_alloc_aligned(site, sz, align);
+  in_sicm = 0;
+  return new_or_abort(ret, sz);
+}
+
+void *_ZnamSt11align_val_t(size_t sz, size_t align) {
+  void *ret;
+  preload_enter(new_or_abort(je_aligned_alloc(align, sz), sz))
+  ret = sh_alloc_aligned(site, sz, align);
+  in_sicm = 0;
+  return new_or_abort(ret, sz);
+}
+
+void *_ZnwmSt11align_val_tRKSt9nothrow_t(size_t sz, size_t align, const void *nothrow) {
+  void *ret;
+  preload_enter(je_aligned_alloc(align, sz))
+  ret = sh_alloc_aligned(site, sz, align);
+  preload_leave(ret)
+}
+
+void *_ZnamSt11align_val_tRKSt9nothrow_t(size_t sz, size_t align, const void *nothrow) {
+  void *ret;
+  preload_enter(je_aligned_alloc(align, sz))
+  ret = sh_alloc_aligned(site, sz, align);
+  preload_leave(ret)
+}
+
+void _ZdlPv(void *ptr) {
+  free(ptr);
+}
+
+void _ZdaPv(void *ptr) {
+  free(ptr);
+}
+
+void _ZdlPvRKSt9nothrow_t(void *ptr, const void *nothrow) {
+  free(ptr);
+}
+
+void _ZdaPvRKSt9nothrow_t(void *ptr, const void *nothrow) {
+  free(ptr);
+}
+
+/* The sized and aligned deletes pass what they know on to jemalloc */
+#define preload_free_sized(PTR, SZ, ALIGN) \
+  if(in_sicm || sh_internal_thread) { \
+    je_free(PTR); \
+    return; \
+  } \
+  in_sicm = 1; \
+  sh_free_sized_aligned((PTR), (SZ), (ALIGN)); \
+  in_sicm = 0;
+
+void _ZdlPvm(void *ptr, size_t sz) {
+  preload_free_sized(ptr, sz, 0)
+}
+
+void _ZdaPvm(void *ptr, size_t sz) {
+  preload_free_sized(ptr, sz, 0)
+}
+
+void _ZdlPvSt11align_val_t(void *ptr, size_t align) {
+  preload_free_sized(ptr, 0, align)
+}
+
+void _ZdaPvSt11align_val_t(void *ptr, size_t align) {
+  preload_free_sized(ptr, 0, align)
+}
+
+void _ZdlPvmSt11align_val_t(void *ptr, size_t sz, size_t align) {
+  preload_free_sized(ptr, sz, align)
+}
+
+void _ZdaPvmSt11align_val_t(void *ptr, size_t sz, size_t align) {
+  preload_free_sized(ptr, sz, align)
+}
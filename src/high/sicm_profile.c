@@ -2,9 +2,15 @@
 #include "sicm_high.h"
 #include "sicm_profile.h"
 #include "sicm_impl.h"
+#include "sicm_lifetime.h"
+#include "sicm_timeseries.h"
+#include "sicm_pagescan.h"
+#include "sicm_damon.h"
+#include "sicm_rss.h"
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <math.h>
 
 profile_thread prof;
 use_tree(double, size_t);
@@ -21,13 +27,53 @@ const char* bandwidth_event_strs[] = {
   NULL
 };
 
+/* Loads that take at least SH_PROFILE_ALL_LATENCY cycles, for when
+ * samples are weighted by their latency
+ */
+const char* latency_event_strs[] = {
+  "MEM_TRANS_RETIRED.LOAD_LATENCY",
+  NULL
+};
+
+const char* store_event_strs[] = {
+  "MEM_INST_RETIRED.ALL_STORES",
+  "MEM_UOPS_RETIRED.ALL_STORES",
+  NULL
+};
+
 int num_events;
+static int sample_pebs; /* Whether profile_all reads perf rings */
+static int rss_thread;  /* Whether profile_rss runs. The pagemap backend gets RSS itself. */
+
+/* Encodes the first event in `event_strs` that libpfm knows into `pe`, with
+ * `modifiers` appended if they're given. Returns the event, or NULL.
+ */
+static const char **sh_encode_event(const char **event_strs, const char *modifiers, struct perf_event_attr *pe) {
+  const char **event;
+  char buf[256];
+  int err;
+
+  for(event = event_strs; *event != NULL; event++) {
+    memset(pe, 0, sizeof(struct perf_event_attr));
+    pe->size = sizeof(struct perf_event_attr);
+    memset(prof.pfm, 0, sizeof(pfm_perf_encode_arg_t));
+    prof.pfm->size = sizeof(pfm_perf_encode_arg_t);
+    prof.pfm->attr = pe;
+    snprintf(buf, sizeof(buf), "%s%s", *event, modifiers ? modifiers : "");
+    err = pfm_get_os_event_encoding(buf, PFM_PLM2 | PFM_PLM3, PFM_OS_PERF_EVENT, prof.pfm);
+    if(err == PFM_SUCCESS) {
+      printf("Using event: %s (0x%llx)\n", buf, pe->config);
+      return event;
+    }
+  }
+  return NULL;
+}
 
 /* Uses libpfm to figure out the event we're going to use */
 void sh_get_event() {
-  const char **event_strs;
-  char **event, *buf;
-  int err, found, i;
+  const char **event_strs, **event;
+  char *buf, modifiers[32];
+  int err, i;
 
   pfm_initialize();
   prof.pfm = malloc(sizeof(pfm_perf_encode_arg_t));
@@ -42,42 +88,46 @@ void sh_get_event() {
   /* Iterate through the array of event strs and see which one works. 
    * For should_profile_one, just use the first given IMC. */
   if(should_profile_one && profile_one_event) {
-    event = &profile_one_event;
+    event = (const char **) &profile_one_event;
     printf("Using a user-specified event: %s\n", profile_one_event);
   } else {
-    event = event_strs;
-    found = 0;
-    while(*event != NULL) {
-      memset(prof.pes[0], 0, sizeof(struct perf_event_attr));
-      prof.pes[0]->size = sizeof(struct perf_event_attr);
-      memset(prof.pfm, 0, sizeof(pfm_perf_encode_arg_t));
-      prof.pfm->size = sizeof(pfm_perf_encode_arg_t);
-      prof.pfm->attr = prof.pes[0];
-      err = pfm_get_os_event_encoding(*event, PFM_PLM2 | PFM_PLM3, PFM_OS_PERF_EVENT, prof.pfm);
-      if(err == PFM_SUCCESS) {
-        printf("Using event: %s (0x%llx)\n", *event, prof.pes[0]->config);
-        found = 1;
-        break;
-      }
-      event++;
+    modifiers[0] = '\0';
+    if(should_profile_all && profile_all_latency) {
+      /* Sample every load over the threshold, wherever it's served from */
+      event_strs = latency_event_strs;
+      snprintf(modifiers, sizeof(modifiers), ":ldlat=%d", profile_all_latency);
     }
-    if(!found) {
+    event = sh_encode_event(event_strs, modifiers, prof.pes[0]);
+    if(!event) {
       fprintf(stderr, "Couldn't find an appropriate event to use. Aborting.\n");
       exit(1);
     }
   }
 
-  /* If should_profile_all, we're using PEBS and only one event */
+  /* If should_profile_all, we're using PEBS, with a load event and maybe a store event */
   if(should_profile_all) {
-    prof.pes[0]->sample_type = PERF_SAMPLE_ADDR;
-    prof.pes[0]->sample_period = sample_freq;
-    prof.pes[0]->mmap = 1;
-    prof.pes[0]->disabled = 1;
-    prof.pes[0]->exclude_kernel = 1;
-    prof.pes[0]->exclude_hv = 1;
-    prof.pes[0]->precise_ip = 2;
-    prof.pes[0]->task = 1;
-    prof.pes[0]->sample_period = sample_freq;
+    if(profile_all_stores && !sh_encode_event(store_event_strs, NULL, prof.pes[1])) {
+      fprintf(stderr, "Couldn't find an event to sample stores with. Aborting.\n");
+      exit(1);
+    }
+    for(i = 0; i < (profile_all_stores ? 2 : 1); i++) {
+      prof.pes[i]->sample_type = PERF_SAMPLE_ADDR;
+      if(profile_all_latency) {
+        prof.pes[i]->sample_type |= PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC;
+      }
+      prof.pes[i]->sample_period = sample_freq;
+      prof.pes[i]->mmap = 1;
+      prof.pes[i]->disabled = 1;
+      prof.pes[i]->exclude_kernel = 1;
+      prof.pes[i]->exclude_hv = 1;
+      prof.pes[i]->precise_ip = 2;
+      prof.pes[i]->task = 1;
+      prof.pes[i]->inherit = 1;
+      /* Wake the profiler when a ring is half full, so it drains them before they overflow */
+      prof.pes[i]->watermark = 1;
+      prof.pes[i]->wakeup_watermark = (prof.pagesize * max_sample_pages) / 2;
+    }
+    prof.sample_size = sizeof(uint64_t) * (profile_all_latency ? 3 : 1);
 
   /* If we're doing memory bandwidth sampling, initialize the other IMCs with the same event */
   } else if(should_profile_one) {
@@ -118,7 +168,8 @@ int sh_should_stop() {
 }
 
 void sh_start_profile_thread() {
-  size_t i;
+  struct perf_event_attr *pe;
+  size_t i, found;
 
   /* All of this initialization HAS to happen in the main SICM thread.
    * If it's not, the `perf_event_open` system call won't profile
@@ -126,9 +177,15 @@ void sh_start_profile_thread() {
    * it was run in.
    */
 
+  sample_pebs = should_profile_all && (profile_all_backend == PROFILE_BACKEND_PEBS);
+  rss_thread = should_profile_rss &&
+               !(should_profile_all && (profile_all_backend == PROFILE_BACKEND_PAGEMAP));
+
   num_events = 0;
-  if(should_profile_all) {
-    num_events = 1;
+  if(sample_pebs) {
+    /* One event per CPU, and another per CPU for stores */
+    prof.num_cpus = (int) sysconf(_SC_NPROCESSORS_CONF);
+    num_events = prof.num_cpus * (profile_all_stores ? 2 : 1);
   } else if(should_profile_one) {
     num_events = num_imcs;
   }
@@ -144,18 +201,37 @@ void sh_start_profile_thread() {
   }
 
   /* Use libpfm to fill the pe struct */
-  if(should_profile_all || should_profile_one) {
+  if(sample_pebs || should_profile_one) {
     sh_get_event();
   }
 
-  /* Open the perf file descriptor */
-  if(should_profile_all) {
-    prof.fds[0] = syscall(__NR_perf_event_open, prof.pes[0], 0, -1, -1, 0);
-    if (prof.fds[0] == -1) {
-      fprintf(stderr, "Error opening perf event 0x%llx.\n", prof.pes[0]->config);
-      strerror(errno);
+  /* Open the perf file descriptors. For PEBS, open one event per CPU for
+   * this thread. They're inherited by the threads that it creates, and
+   * inherited events can only be mapped when they're bound to a CPU.
+   */
+  if(sample_pebs) {
+    found = 0;
+    for(i = 0; i < num_events; i++) {
+      pe = prof.pes[i / prof.num_cpus];
+      prof.fds[i] = syscall(__NR_perf_event_open, pe, 0, i % prof.num_cpus, -1, 0);
+      if(prof.fds[i] == -1) {
+        /* Offline CPUs don't get an event */
+        if(errno == ENODEV) continue;
+        fprintf(stderr, "Error opening perf event 0x%llx on CPU %zu: %s\n",
+                pe->config, i % prof.num_cpus, strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+      found++;
+    }
+    if(!found) {
+      fprintf(stderr, "Couldn't open a perf event on any CPU. Aborting.\n");
       exit(EXIT_FAILURE);
     }
+  } else if(should_profile_all && (profile_all_backend == PROFILE_BACKEND_PAGEMAP)) {
+    sh_pagescan_init();
+  } else if(should_profile_all && (profile_all_backend == PROFILE_BACKEND_DAMON)) {
+    prof.damon_version = (size_t) -1;
+    sh_damon_init(damon_hot_node, damon_cold_node);
   } else if(should_profile_one) {
     for(i = 0; i < num_events; i++) {
       prof.fds[i] = syscall(__NR_perf_event_open, prof.pes[i], -1, 0, -1, 0);
@@ -168,12 +244,12 @@ void sh_start_profile_thread() {
     }
   }
 
-  if(should_profile_rss) {
-    prof.pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
-    if (prof.pagemap_fd < 0) {
-      fprintf(stderr, "Failed to open /proc/self/pagemap. Aborting.\n");
-      exit(1);
-    }
+  if(rss_thread) {
+    sh_rss_init(profile_rss_threads);
+  }
+
+  if(profile_output_path) {
+    sh_timeseries_start(profile_output_path);
   }
 
   /* Start the profiling threads */
@@ -184,16 +260,19 @@ void sh_start_profile_thread() {
   } else if(should_profile_one) {
     pthread_create(&prof.profile_one_id, NULL, &profile_one, NULL);
   }
-  if(should_profile_rss) {
+  if(rss_thread) {
     pthread_create(&prof.profile_rss_id, NULL, &profile_rss, NULL);
   }
 }
 
 void sh_stop_profile_thread() {
   size_t i, associated;
+  arena_info *arena;
+  int index;
 
   /* Stop the actual sampling */
   for(i = 0; i < num_events; i++) {
+    if(prof.fds[i] == -1) continue;
     ioctl(prof.fds[i], PERF_EVENT_IOC_DISABLE, 0);
   }
 
@@ -204,191 +283,558 @@ void sh_stop_profile_thread() {
   } else if(should_profile_one) {
     pthread_join(prof.profile_one_id, NULL);
   }
-  if(should_profile_rss) {
+  if(rss_thread) {
     pthread_join(prof.profile_rss_id, NULL);
+    sh_rss_terminate();
+  }
+  if(profile_output_path) {
+    sh_timeseries_stop();
   }
 
   for(i = 0; i < num_events; i++) {
+    if(prof.fds[i] == -1) continue;
+    if(sample_pebs) {
+      munmap(prof.rings[i], prof.pagesize + (prof.pagesize * max_sample_pages));
+    }
     close(prof.fds[i]);
   }
+  if(should_profile_all) {
+    close(prof.epoll_fd);
+    free(prof.rings);
+  }
+  if(should_profile_all && (profile_all_backend == PROFILE_BACKEND_PAGEMAP)) {
+    sh_pagescan_terminate();
+  } else if(should_profile_all && (profile_all_backend == PROFILE_BACKEND_DAMON)) {
+    sh_damon_terminate();
+  }
 
   if(should_profile_all) {
+    /* Every backend's results go in this block, so the tools read them the same way */
     printf("===== PEBS RESULTS =====\n");
     associated = 0;
-    for(i = 0; i <= max_index; i++) {
-      if(!arenas[i]) continue;
-      associated += arenas[i]->accesses;
-      printf("Site %u:\n", arenas[i]->id);
-      printf("  Accesses: %zu\n", arenas[i]->accesses);
+    arena_table_for(&arenas, index, arena) {
+      associated += arena->accesses;
+      printf("Site %u:\n", arena->id);
+      printf("  Accesses: %zu\n", arena->accesses);
+      if(profile_all_stores) {
+        printf("  Reads: %zu\n", arena->reads);
+        printf("  Writes: %zu\n", arena->writes);
+      }
+      if(profile_all_latency) {
+        printf("  Weight: %zu\n", arena->weight);
+      }
       if(should_profile_rss) {
-        printf("  Peak RSS: %zu\n", arenas[i]->peak_rss);
+        printf("  Peak RSS: %zu\n", arena->peak_rss);
+        sh_rss_print_nodes(arena);
       }
     }
     printf("Totals: %zu / %zu\n", associated, prof.total);
+    printf("Samples: %zu attributed, %zu unattributed, %zu lost\n",
+           prof.attributed, prof.unattributed, prof.lost);
+    printf("Phases: %u\n", prof.phase + 1);
     printf("===== END PEBS RESULTS =====\n");
+    free(prof.addrs);
+    free(prof.sorted_extents);
   } else if(should_profile_one) {
     printf("===== MBI RESULTS FOR SITE %u =====\n", should_profile_one);
     printf("Average bandwidth: %.1f MB/s\n", prof.running_avg);
-    if(should_profile_rss) {
-      printf("Peak RSS: %zu\n", arenas[should_profile_one]->peak_rss);
+    arena = arena_table_get(&arenas, should_profile_one);
+    if(should_profile_rss && arena) {
+      printf("Peak RSS: %zu\n", arena->peak_rss);
     }
     printf("===== END MBI RESULTS =====\n");
   } else if(should_profile_rss) {
     printf("===== RSS RESULTS =====\n");
-    for(i = 0; i <= max_index; i++) {
-      if(!arenas[i]) continue;
-      printf("Site %u:\n", arenas[i]->id);
+    arena_table_for(&arenas, index, arena) {
+      printf("Site %u:\n", arena->id);
       if(should_profile_rss) {
-        printf("  Peak RSS: %zu\n", arenas[i]->peak_rss);
+        printf("  Peak RSS: %zu\n", arena->peak_rss);
+        sh_rss_print_nodes(arena);
       }
     }
     printf("===== END RSS RESULTS =====\n");
   }
 }
 
-/* Adds up accesses to the arenas */
-static void
-get_accesses() {
-  uint64_t head, tail, buf_size;
+/* Whether an arena is bound to just this device */
+static int arena_on_device(sicm_arena arena, sicm_device *device) {
+  sicm_device_list devs;
+  int ret;
+
+  devs = sicm_arena_get_devices(arena);
+  ret = (devs.count == 1) && (devs.devices[0] == device);
+  free(devs.devices);
+  return ret;
+}
+
+/* The NUMA node that an arena is bound to, or -1 if it spans several */
+static int arena_node(sicm_arena arena) {
+  sicm_device_list devs;
+  int node;
+
+  devs = sicm_arena_get_devices(arena);
+  node = (devs.count == 1) ? sicm_numa_id(devs.devices[0]) : -1;
+  free(devs.devices);
+  return node;
+}
+
+static int record_cmp(const void *a, const void *b) {
+  uint32_t x = ((const timeseries_record *) a)->site, y = ((const timeseries_record *) b)->site;
+
+  return (x > y) - (x < y);
+}
+
+/* Writes this interval's accesses, weight and RSS of every site to SH_PROFILE_OUTPUT.
+ * In the exclusive layouts, a site has an arena per thread, so its arenas
+ * are added up into one record. Its node is -1 unless they all agree.
+ */
+static void record_interval() {
+  static timeseries_record *records = NULL;
+  static size_t max_records = 0;
+  timeseries_record *record, *site;
   arena_info *arena;
-  void *addr;
-  char *base, *begin, *end, break_next_site;
-  size_t i, packed_size, total_value;
-  struct sample *sample;
-  struct perf_event_header *header;
-  double acc_per_byte;
-  tree(double, size_t) sorted_arenas;
-  tree(size_t, deviceptr) new_knapsack;
-  tree_it(double, size_t) it;
-  tree_it(size_t, deviceptr) kit;
-  tree_it(unsigned, deviceptr) sit;
-  int err;
+  size_t num, i;
+  uint64_t now;
+  int index;
+
+  now = sh_timeseries_now();
+  num = 0;
+  arena_table_for(&arenas, index, arena) {
+    if(num == max_records) {
+      max_records = max_records ? max_records * 2 : 64;
+      records = realloc(records, max_records * sizeof(timeseries_record));
+    }
+    record = &records[num++];
+    record->time_ms = now;
+    record->site = arena->id;
+    record->node = arena_node(arena->arena);
+    record->accesses = arena->interval_accesses;
+    record->reads = arena->interval_reads;
+    record->writes = arena->interval_writes;
+    record->weight = arena->interval_weight;
+    record->rss = arena->rss;
+    record->bandwidth = 0;
+    record->phase = prof.phase;
+    arena->interval_accesses = 0;
+    arena->interval_reads = 0;
+    arena->interval_writes = 0;
+    arena->interval_weight = 0;
+  }
+
+  qsort(records, num, sizeof(timeseries_record), &record_cmp);
+  site = NULL;
+  for(i = 0; i < num; i++) {
+    if(site && (site->site == records[i].site)) {
+      site->accesses += records[i].accesses;
+      site->reads += records[i].reads;
+      site->writes += records[i].writes;
+      site->weight += records[i].weight;
+      site->rss += records[i].rss;
+      if(site->node != records[i].node) {
+        site->node = -1;
+      }
+      continue;
+    }
+    if(site) {
+      sh_timeseries_record(site);
+    }
+    site = &records[i];
+  }
+  if(site) {
+    sh_timeseries_record(site);
+  }
+}
+
+/* Copies `len` bytes at `offset` out of the perf ring buffer, wrapping around its end */
+static void read_ring(char *base, uint64_t buf_size, uint64_t offset, void *dst, size_t len) {
+  size_t first;
+
+  offset %= buf_size;
+  first = buf_size - offset;
+  if(first >= len) {
+    memcpy(dst, base + offset, len);
+  } else {
+    memcpy(dst, base + offset, first);
+    memcpy((char *) dst + first, base, len - first);
+  }
+}
+
+static int addr_cmp(const void *a, const void *b) {
+  uint64_t x = ((const sampled_access *) a)->addr, y = ((const sampled_access *) b)->addr;
+
+  return (x > y) - (x < y);
+}
+
+static int extent_cmp(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t) ((const extent_info *) a)->start,
+            y = (uintptr_t) ((const extent_info *) b)->start;
+
+  return (x > y) - (x < y);
+}
+
+/* Copies the extents into prof.sorted_extents, sorted by start address.
+ * Only does anything if they've changed since the last copy.
+ */
+static void sort_extents() {
+  size_t i;
+
+  pthread_rwlock_rdlock(&extents_lock);
+  if(prof.sorted_extents && (prof.sorted_version == extents_version)) {
+    pthread_rwlock_unlock(&extents_lock);
+    return;
+  }
+  if(prof.max_sorted_extents < extents->index) {
+    prof.max_sorted_extents = extents->max_extents;
+    prof.sorted_extents = realloc(prof.sorted_extents, prof.max_sorted_extents * sizeof(extent_info));
+  }
+  prof.num_sorted_extents = 0;
+  extent_arr_for(extents, i) {
+    if(!extents->arr[i].start && !extents->arr[i].end) continue;
+    /* Nothing to attribute to; its samples count as unattributed */
+    if(!extents->arr[i].arena) continue;
+    prof.sorted_extents[prof.num_sorted_extents++] = extents->arr[i];
+  }
+  prof.sorted_version = extents_version;
+  pthread_rwlock_unlock(&extents_lock);
 
-  /* Wait for the perf buffer to be ready */
-  prof.pfd.fd = prof.fds[0];
-  prof.pfd.events = POLLIN;
-  prof.pfd.revents = 0;
-  err = poll(&prof.pfd, 1, 0);
-  if(err == 0) {
+  qsort(prof.sorted_extents, prof.num_sorted_extents, sizeof(extent_info), &extent_cmp);
+}
+
+/* Attributes the sorted sample addresses to arenas by walking them and the
+ * sorted extents together. Extents don't overlap, so each address lands in
+ * at most one, and the whole pass is linear.
+ */
+static void attribute_samples() {
+  extent_info *ext;
+  arena_info *arena;
+  size_t i, e;
+
+  if(!prof.num_addrs) {
     return;
-  } else if(err == -1) {
-    fprintf(stderr, "Error occurred polling. Aborting.\n");
-    exit(1);
   }
+  qsort(prof.addrs, prof.num_addrs, sizeof(sampled_access), &addr_cmp);
+  sort_extents();
+
+  e = 0;
+  for(i = 0; i < prof.num_addrs; i++) {
+    while((e < prof.num_sorted_extents) &&
+          (prof.addrs[i].addr >= (uintptr_t) prof.sorted_extents[e].end)) {
+      e++;
+    }
+    if(e == prof.num_sorted_extents) {
+      /* Past the last extent */
+      prof.unattributed += prof.num_addrs - i;
+      break;
+    }
+    ext = &prof.sorted_extents[e];
+    if(prof.addrs[i].addr >= (uintptr_t) ext->start) {
+      arena = ext->arena;
+      arena->accesses++;
+      arena->interval_accesses++;
+      if(prof.addrs[i].store) {
+        arena->writes++;
+        arena->interval_writes++;
+      } else {
+        arena->reads++;
+        arena->interval_reads++;
+      }
+      arena->weight += prof.addrs[i].weight;
+      arena->interval_weight += prof.addrs[i].weight;
+      prof.attributed++;
+    } else {
+      prof.unattributed++;
+    }
+  }
+  prof.num_addrs = 0;
+}
+
+/* Maps DAMON's regions onto the extents that they overlap. A region's heat
+ * is the number of samples in the last aggregation interval that found it
+ * accessed, for each of its pages. Extents that DAMON hasn't seen yet are
+ * handed to it first.
+ */
+static void get_damon_accesses() {
+  damon_region *regions;
+  extent_info *ext;
+  arena_info *arena;
+  size_t num_regions, r, e, heat;
+  uint64_t lo, hi;
+
+  sort_extents();
+  if(prof.damon_version != prof.sorted_version) {
+    sh_damon_set_targets(prof.sorted_extents, prof.num_sorted_extents);
+    prof.damon_version = prof.sorted_version;
+  }
+
+  /* Both are sorted, and neither overlaps itself */
+  num_regions = sh_damon_get_regions(&regions);
+  r = 0;
+  e = 0;
+  while((r < num_regions) && (e < prof.num_sorted_extents)) {
+    ext = &prof.sorted_extents[e];
+    lo = (regions[r].start > (uintptr_t) ext->start) ? regions[r].start : (uintptr_t) ext->start;
+    hi = (regions[r].end < (uintptr_t) ext->end) ? regions[r].end : (uintptr_t) ext->end;
+    if(lo < hi) {
+      arena = ext->arena;
+      heat = (size_t) regions[r].nr_accesses * ((hi - lo) / prof.pagesize);
+      arena->accesses += heat;
+      arena->interval_accesses += heat;
+    }
+    if(regions[r].end < (uintptr_t) ext->end) {
+      r++;
+    } else {
+      e++;
+    }
+  }
+}
+
+/* Whether a sample's data came from memory, rather than from a cache or a
+ * line that was already on its way in, like one that was prefetched
+ */
+static int
+from_memory(uint64_t data_src) {
+  union perf_mem_data_src src;
+
+  src.val = data_src;
+  return (src.mem_lvl & PERF_MEM_LVL_HIT) &&
+         (src.mem_lvl & (PERF_MEM_LVL_LOC_RAM | PERF_MEM_LVL_REM_RAM1 | PERF_MEM_LVL_REM_RAM2));
+}
+
+/* Copies the samples out of an event's ring buffer, so that perf gets its
+ * space back before we spend any time attributing them. The first
+ * prof.num_cpus rings are loads, and the rest are stores.
+ */
+static void
+read_samples(int cpu) {
+  struct perf_event_mmap_page *ring;
+  sampled_access *access;
+  uint64_t head, tail, buf_size;
+  char *base;
+  struct sample sample;
+  struct lost lost;
+  struct perf_event_header header;
 
   /* Get ready to read */
-  head = prof.metadata->data_head;
-  tail = prof.metadata->data_tail;
+  ring = prof.rings[cpu];
+  head = ring->data_head;
+  tail = ring->data_tail;
   buf_size = prof.pagesize * max_sample_pages;
   asm volatile("" ::: "memory"); /* Block after reading data_head, per perf docs */
 
-  base = (char *)prof.metadata + prof.pagesize;
-  begin = base + tail % buf_size;
-  end = base + head % buf_size;
-
-  /* Read all of the samples */
-  pthread_rwlock_rdlock(&extents_lock);
-  while(begin != end) {
+  base = (char *)ring + prof.pagesize;
 
-    header = (struct perf_event_header *)begin;
-    if(header->size == 0) {
+  while(tail < head) {
+    read_ring(base, buf_size, tail, &header, sizeof(header));
+    if(header.size == 0) {
       break;
     }
-    sample = (struct sample *) (begin + 8);
-    addr = (void *) (sample->addr);
-
-    if(addr) {
-      prof.total++;
-      /* Search for which extent it goes into */
-      extent_arr_for(extents, i) {
-        if(!extents->arr[i].start && !extents->arr[i].end) continue;
-        arena = extents->arr[i].arena;
-        if((addr >= extents->arr[i].start) && (addr <= extents->arr[i].end)) {
-          arena->accesses++;
+    if(header.type == PERF_RECORD_SAMPLE) {
+      read_ring(base, buf_size, tail + sizeof(header), &sample, prof.sample_size);
+      if(sample.addr) {
+        prof.total++;
+        if(prof.num_addrs == prof.max_addrs) {
+          prof.max_addrs = prof.max_addrs ? prof.max_addrs * 2 : 4096;
+          prof.addrs = realloc(prof.addrs, prof.max_addrs * sizeof(sampled_access));
         }
+        access = &prof.addrs[prof.num_addrs++];
+        access->addr = sample.addr;
+        access->store = (cpu >= prof.num_cpus);
+        /* Only loads that waited on memory count toward a site's weight */
+        access->weight = 0;
+        if(profile_all_latency && !access->store && from_memory(sample.data_src)) {
+          access->weight = sample.weight;
+        }
+      }
+    } else if(header.type == PERF_RECORD_LOST) {
+      /* The kernel dropped samples because we fell behind */
+      read_ring(base, buf_size, tail + sizeof(header), &lost, sizeof(lost));
+      prof.lost += lost.lost;
+    }
+    tail += header.size;
+  }
+
+  /* Let perf know that we've read this far */
+  __sync_synchronize();
+  ring->data_tail = head;
+}
+
+/* What online profiling ranks an arena by: its latency-weighted cost, or its accesses */
+static inline size_t
+site_value(arena_info *arena) {
+  return profile_all_latency ? arena->weight : arena->accesses;
+}
+
+/* What online profiling places sites by: their decayed rate, or with no
+ * decay, their totals since startup
+ */
+static inline double
+rank_value(arena_info *arena) {
+  return (profile_all_decay > 0) ? arena->rate : (double) site_value(arena);
+}
+
+/* Decays each site's rate, and compares the sites' share of the accesses in
+ * the last PHASE_WINDOW intervals to their share since the current phase
+ * began. If they're further apart than SH_PROFILE_ALL_PHASE_THRESHOLD, a new
+ * phase starts with the latest interval, and the rates start over from it,
+ * so that online profiling places sites for the new phase right away. The
+ * next check waits until the window is all in the new phase.
+ */
+static void
+update_phases() {
+  arena_info *arena;
+  size_t value, delta, recent, total_recent, total_phase, slot, w;
+  double distance;
+  int index;
+
+  slot = prof.phase_intervals % PHASE_WINDOW;
+  prof.phase_intervals++;
+  total_recent = 0;
+  total_phase = 0;
+  arena_table_for(&arenas, index, arena) {
+    value = site_value(arena);
+    delta = value - arena->prev_value;
+    arena->prev_value = value;
+    arena->rate += profile_all_decay * ((double) delta - arena->rate);
+    arena->recent[slot] = delta;
+    for(w = 0; w < PHASE_WINDOW; w++) {
+      total_recent += arena->recent[w];
+    }
+    total_phase += arena->phase_value;
+  }
+
+  /* The distance between the two profiles, each normalized to add up to 1 */
+  distance = 0;
+  if((phase_threshold > 0) && (prof.phase_intervals - prof.phase_start >= PHASE_WINDOW) &&
+     total_recent && total_phase) {
+    arena_table_for(&arenas, index, arena) {
+      recent = 0;
+      for(w = 0; w < PHASE_WINDOW; w++) {
+        recent += arena->recent[w];
       }
+      distance += fabs(((double) recent / total_recent) - ((double) arena->phase_value / total_phase));
     }
+  }
 
-    /* Increment begin by the size of the sample */
-    if(((char *)header + header->size) == base + buf_size) {
-      begin = base;
+  if(distance > phase_threshold) {
+    prof.phase++;
+    prof.phase_start = prof.phase_intervals - 1;
+    printf("Phase %u started at interval %zu, with a distance of %.2f.\n",
+           prof.phase, prof.phase_intervals, distance);
+  }
+  arena_table_for(&arenas, index, arena) {
+    if(distance > phase_threshold) {
+      arena->phase_value = arena->recent[slot];
+      arena->rate = (double) arena->recent[slot];
     } else {
-      begin = begin + header->size;
+      arena->phase_value += arena->recent[slot];
     }
   }
-  pthread_rwlock_unlock(&extents_lock);
+}
 
-  /* Let perf know that we've read this far */
-  prof.metadata->data_tail = head;
-  __sync_synchronize();
+/* Adds up accesses to the arenas */
+static void
+get_accesses() {
+  arena_info *arena;
+  size_t packed_size, total_value;
+  ssize_t cap;
+  sicm_device *device;
+  double acc_per_byte;
+  tree(double, size_t) sorted_arenas;
+  tree(size_t, deviceptr) new_knapsack;
+  tree_it(double, size_t) it;
+  tree_it(size_t, deviceptr) kit;
+  site_placement placement;
+  int index, tier, cpu;
+
+  /* Drain what's left in every ring, then attribute the whole interval */
+  for(cpu = 0; cpu < num_events; cpu++) {
+    if(prof.fds[cpu] == -1) continue;
+    read_samples(cpu);
+  }
+  attribute_samples();
+  update_phases();
 
   if(should_profile_online) {
     printf("===== STARTING RECONFIGURING =====\n");
     /* Sort all sites by accesses/byte */
     sorted_arenas = tree_make(double, size_t); /* acc_per_byte -> arena index */
-    packed_size = 0;
-    for(i = 0; i <= max_index; i++) {
-      if(!arenas[i]) continue;
-      if(arenas[i]->peak_rss == 0) continue;
-      if(arenas[i]->accesses == 0) continue;
-      acc_per_byte = ((double)arenas[i]->accesses) / ((double) arenas[i]->peak_rss);
+    arena_table_for(&arenas, index, arena) {
+      /* Pooled arenas hold many small sites, and stay on their device.
+       * Under SH_AGGREGATE_ARENAS, though, a group is packed as a unit.
+       */
+      if((arena->id == POOL_SITE_ID) && !aggregate_arenas) continue;
+      /* Pinned sites stay where they are, and don't take up a tier */
+      if((arena->id != POOL_SITE_ID) && (get_site_placement(arena->id).obj.flags & SITE_PINNED)) continue;
+      /* Short-lived sites stay on the default device. Their memory would be
+       * freed before moving it paid off.
+       */
+      if((arena->id != POOL_SITE_ID) && sh_site_is_short_lived(arena->id)) continue;
+      if(arena->peak_rss == 0) continue;
+      if(rank_value(arena) == 0) continue;
+      acc_per_byte = rank_value(arena) / ((double) arena->peak_rss);
       it = tree_lookup(sorted_arenas, acc_per_byte);
       while(tree_it_good(it)) {
         /* Inch this site a little higher to avoid collisions in the tree */
         acc_per_byte += 0.000000000000000001;
         it = tree_lookup(sorted_arenas, acc_per_byte);
       }
-      tree_insert(sorted_arenas, acc_per_byte, i);
+      tree_insert(sorted_arenas, acc_per_byte, index);
     }
 
-    /* Use a greedy algorithm to pack sites into the knapsack */
-    total_value = 0;
-    break_next_site = 0;
-    new_knapsack = tree_make(size_t, deviceptr); /* arena index -> online_device */
+    /* Use a greedy algorithm to fill the tiers in order, hottest sites first.
+     * A tier overflows by one site before the next one starts filling.
+     */
+    new_knapsack = tree_make(size_t, deviceptr); /* arena index -> tier's device */
     it = tree_last(sorted_arenas);
-    while(tree_it_good(it)) {
-      packed_size += arenas[tree_it_val(it)]->peak_rss;
-      total_value += arenas[tree_it_val(it)]->accesses;
-      tree_insert(new_knapsack, tree_it_val(it), online_device);
-      printf("%zu ", arenas[tree_it_val(it)]->id);
-      if(break_next_site) {
-        break;
-      }
-      if(packed_size > online_device_cap) {
-        break_next_site = 1;
-      }
-      tree_it_prev(it);
-    }
-    printf("\n");
-    printf("Total value: %zu\n", total_value);
-    printf("Packed size: %zu\n", packed_size);
-    printf("Capacity:    %zd\n", online_device_cap);
-
-    /* Get rid of sites that aren't in the new knapsack but are in the old */
-    tree_traverse(site_nodes, sit) {
-      i = get_arena_index(tree_it_key(sit));
-      kit = tree_lookup(new_knapsack, i);
-      if(!tree_it_good(kit)) {
-        /* The site isn't in the new, so remove it from the upper tier */
-        tree_delete(site_nodes, tree_it_key(sit));
-        sicm_arena_set_device(arenas[i]->arena, default_device);
-        printf("Moving %u out of the MCDRAM\n", tree_it_key(sit));
+    for(tier = 0; tier < num_online_tiers; tier++) {
+      device = __atomic_load_n(&online_tiers[tier], __ATOMIC_RELAXED);
+      cap = __atomic_load_n(&online_tier_caps[tier], __ATOMIC_RELAXED);
+      packed_size = 0;
+      total_value = 0;
+      printf("Tier %d: ", tier);
+      while(tree_it_good(it) && (packed_size <= cap)) {
+        arena = arena_table_get(&arenas, tree_it_val(it));
+        packed_size += arena->peak_rss;
+        total_value += site_value(arena);
+        tree_insert(new_knapsack, tree_it_val(it), device);
+        printf("%u ", arena->id);
+        tree_it_prev(it);
       }
+      printf("\n");
+      printf("Total value: %zu\n", total_value);
+      printf("Packed size: %zu\n", packed_size);
+      printf("Capacity:    %zd\n", cap);
     }
 
-    /* Add sites that weren't in the old knapsack but are in the new */
-    tree_traverse(new_knapsack, kit) {
-      /* Lookup this site in the old knapsack */
-      sit = tree_lookup(site_nodes, arenas[tree_it_key(kit)]->id);
-      if(!tree_it_good(sit)) {
-        /* This site is in the new but not the old */
-        tree_insert(site_nodes, arenas[tree_it_key(kit)]->id, online_device);
-        sicm_arena_set_device(arenas[tree_it_key(kit)]->arena, online_device);
-        printf("Moving %u into the MCDRAM\n", arenas[tree_it_key(kit)]->id);
+    /* Compare the new knapsack to the current placements. Each site's
+     * placement is republished before its arena is rebound, so allocating
+     * threads never see a half-updated site.
+     */
+    arena_table_for(&arenas, index, arena) {
+      if((arena->id == POOL_SITE_ID) && !aggregate_arenas) continue;
+      kit = tree_lookup(new_knapsack, index);
+      device = tree_it_good(kit) ? tree_it_val(kit) : default_device;
+      if(arena->id == POOL_SITE_ID) {
+        /* A group of sites moves as a whole. Its sites keep their placements,
+         * so they keep allocating from it.
+         */
+        if(!arena_on_device(arena->arena, device)) {
+          sicm_arena_set_device(arena->arena, device);
+          printf("Moving group %d to NUMA node %d\n", index, sicm_numa_id(device));
+        }
+        continue;
+      }
+      placement = get_site_placement(arena->id);
+      if(placement.obj.flags & SITE_PINNED) continue;
+      if(get_site_device(arena->id) != device) {
+        set_site_device(arena->id, tree_it_good(kit) ? device : NULL);
+        sicm_arena_set_device(arena->arena, device);
+        printf("Moving %u to NUMA node %d\n", arena->id, sicm_numa_id(device));
       }
     }
 
     tree_free(sorted_arenas);
+    tree_free(new_knapsack);
   }
 }
 
@@ -399,6 +845,8 @@ get_bandwidth()
   long long count;
   int num, i;
   struct itimerspec it;
+  timeseries_record record;
+  arena_info *arena;
 
   /* Stop the counter and read the value if it has been at least a second */
   total = 0;
@@ -414,114 +862,143 @@ get_bandwidth()
   }
 
   printf("%.2f MB/s\n", total);
+
+  if(profile_output_path) {
+    record.time_ms = sh_timeseries_now();
+    record.site = should_profile_one;
+    record.accesses = 0;
+    record.reads = 0;
+    record.writes = 0;
+    record.weight = 0;
+    record.rss = 0;
+    record.bandwidth = total;
+    record.node = -1;
+    record.phase = 0;
+    arena = arena_table_get(&arenas, should_profile_one);
+    if(arena) {
+      record.rss = arena->rss;
+      record.node = arena_node(arena->arena);
+    }
+    sh_timeseries_record(&record);
+  }
   
   /* Calculate the running average */
   prof.num_intervals++;
   prof.running_avg = ((prof.running_avg * (prof.num_intervals - 1)) + total) / prof.num_intervals;
 }
 
-static void
-get_rss() {
-	size_t i, n, numpages;
-  uint64_t start, end;
-  arena_info *arena;
-  ssize_t num_read;
-
-  /* Grab the lock for the extents array */
-  pthread_rwlock_rdlock(&extents_lock);
-
-	/* Zero out the RSS values for each arena */
-	extent_arr_for(rss_extents, i) {
-    arena = rss_extents->arr[i].arena;
-		arena->rss = 0;
-	}
-
-	/* Iterate over the chunks */
-	extent_arr_for(rss_extents, i) {
-		start = (uint64_t) rss_extents->arr[i].start;
-		end = (uint64_t) rss_extents->arr[i].end;
-		arena = rss_extents->arr[i].arena;
-
-    numpages = (end - start) /prof.pagesize;
-		prof.pfndata = (union pfn_t *) realloc(prof.pfndata, numpages * prof.addrsize);
-
-		/* Seek to the starting of this chunk in the pagemap */
-		if(lseek64(prof.pagemap_fd, (start / prof.pagesize) * prof.addrsize, SEEK_SET) == ((off64_t) - 1)) {
-			close(prof.pagemap_fd);
-			fprintf(stderr, "Failed to seek in the PageMap file. Aborting.\n");
-			exit(1);
-		}
-
-		/* Read in all of the pfns for this chunk */
-    if(read(prof.pagemap_fd, prof.pfndata, prof.addrsize * numpages) != (prof.addrsize * numpages)) {
-			fprintf(stderr, "Failed to read the PageMap file. Aborting.\n");
-			exit(1);
-		}
-
-		/* Iterate over them and check them, sum up RSS in arena->rss */
-		for(n = 0; n < numpages; n++) {
-			if(!(prof.pfndata[n].obj.present)) {
-				continue;
-		  }
-      arena->rss += prof.pagesize;
-		}
-
-		/* Maintain the peak for this arena */
-		if(arena->rss > arena->peak_rss) {
-			arena->peak_rss = arena->rss;
-		}
-	}
-  pthread_rwlock_unlock(&extents_lock);
-}
-
 void *profile_rss(void *a) {
   struct timespec timer;
 
-  prof.pagesize = (size_t) sysconf(_SC_PAGESIZE);
-
-  prof.pfndata = NULL;
-  prof.addrsize = sizeof(uint64_t);
+  sh_internal_thread = 1;
 
   timer.tv_sec = 1;
   timer.tv_nsec = 0;
 
   while(!sh_should_stop()) {
-    get_rss();
+    sh_rss_scan();
+    /* profile_all writes the RSS along with its accesses */
+    if(profile_output_path && !should_profile_all && !should_profile_one) {
+      record_interval();
+    }
     nanosleep(&timer, NULL);
   }
 }
 
-void *profile_all(void *a) {
-  struct timespec timer;
+static uint64_t
+now_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
 
-  /* mmap the file */
-  prof.metadata = mmap(NULL, prof.pagesize + (prof.pagesize * max_sample_pages), PROT_READ | PROT_WRITE, MAP_SHARED, prof.fds[0], 0);
-  if(prof.metadata == MAP_FAILED) {
-    fprintf(stderr, "Failed to mmap room (%zu bytes) for perf samples. Aborting with:\n%s\n", prof.pagesize + (prof.pagesize * max_sample_pages), strerror(errno));
+void *profile_all(void *a) {
+  struct epoll_event ev, *events;
+  uint64_t interval, next, now;
+  int cpu, i, n;
+
+  sh_internal_thread = 1;
+
+  /* mmap a ring for each CPU, and watch them all with epoll */
+  prof.rings = calloc(num_events, sizeof(struct perf_event_mmap_page *));
+  /* One more than the rings, so that epoll_wait still works as a timer without any */
+  events = calloc(num_events + 1, sizeof(struct epoll_event));
+  prof.epoll_fd = epoll_create1(0);
+  if(prof.epoll_fd == -1) {
+    fprintf(stderr, "Failed to create an epoll instance. Aborting.\n");
     exit(1);
   }
+  for(cpu = 0; cpu < num_events; cpu++) {
+    if(prof.fds[cpu] == -1) continue;
+    prof.rings[cpu] = mmap(NULL, prof.pagesize + (prof.pagesize * max_sample_pages), PROT_READ | PROT_WRITE, MAP_SHARED, prof.fds[cpu], 0);
+    if(prof.rings[cpu] == MAP_FAILED) {
+      fprintf(stderr, "Failed to mmap room (%zu bytes) for perf samples. Aborting with:\n%s\n", prof.pagesize + (prof.pagesize * max_sample_pages), strerror(errno));
+      exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = cpu;
+    if(epoll_ctl(prof.epoll_fd, EPOLL_CTL_ADD, prof.fds[cpu], &ev) == -1) {
+      fprintf(stderr, "Failed to add CPU %d's perf event to epoll. Aborting.\n", cpu);
+      exit(1);
+    }
+  }
 
   /* Initialize */
-  ioctl(prof.fds[0], PERF_EVENT_IOC_RESET, 0);
-  ioctl(prof.fds[0], PERF_EVENT_IOC_ENABLE, 0);
+  for(cpu = 0; cpu < num_events; cpu++) {
+    if(prof.fds[cpu] == -1) continue;
+    ioctl(prof.fds[cpu], PERF_EVENT_IOC_RESET, 0);
+    ioctl(prof.fds[cpu], PERF_EVENT_IOC_ENABLE, 0);
+  }
   prof.consumed = 0;
   prof.total = 0;
   prof.oops = 0;
+  prof.addrs = NULL;
+  prof.num_addrs = 0;
+  prof.max_addrs = 0;
+  prof.sorted_extents = NULL;
+  prof.num_sorted_extents = 0;
+  prof.max_sorted_extents = 0;
+  prof.attributed = 0;
+  prof.unattributed = 0;
+  prof.lost = 0;
+  prof.phase = 0;
+  prof.phase_intervals = 0;
+  prof.phase_start = 0;
 
   printf("Going to profile all every %f seconds.\n", profile_all_rate);
-  timer.tv_sec = profile_all_rate;
-  timer.tv_nsec = 0;
+  interval = (uint64_t) (profile_all_rate * 1000);
+  next = now_ms() + interval;
 
+  /* Drain rings as they fill up, and attribute everything once per interval */
   while(!sh_should_stop()) {
-    get_accesses();
-    nanosleep(&timer, NULL);
+    now = now_ms();
+    n = epoll_wait(prof.epoll_fd, events, num_events + 1, (next > now) ? (int) (next - now) : 0);
+    for(i = 0; i < n; i++) {
+      read_samples(events[i].data.u32);
+    }
+    if(now_ms() >= next) {
+      if(profile_all_backend == PROFILE_BACKEND_PAGEMAP) {
+        sh_pagescan_interval();
+      } else if(profile_all_backend == PROFILE_BACKEND_DAMON) {
+        get_damon_accesses();
+      }
+      get_accesses();
+      if(profile_output_path) {
+        record_interval();
+      }
+      next += interval;
+    }
   }
+  free(events);
 }
 
 void *profile_one(void *a) {
   int i;
   struct timespec timer;
 
+  sh_internal_thread = 1;
+
   for(i = 0; i < num_events; i++) {
     ioctl(prof.fds[i], PERF_EVENT_IOC_RESET, 0);
     ioctl(prof.fds[i], PERF_EVENT_IOC_ENABLE, 0);
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <numa.h>
+#include <numaif.h>
+
+#include "sicm_high.h"
+#include "sicm_rss.h"
+
+#define PAGEMAP_PRESENT (1ULL << 63)
+
+/* What we know about an extent between passes */
+typedef struct rss_extent {
+  uint64_t start, end;
+  arena_info *arena;
+  size_t present; /* Resident pages, as of its last scan */
+  size_t offset;  /* Moves the sampled runs along, for large extents */
+  char stale;     /* New, so it has to be scanned this pass */
+} rss_extent;
+
+/* Each scanning thread's buffers */
+typedef struct rss_scratch {
+  uint64_t entries[RSS_RUN_PAGES];
+  void *pages[RSS_NODE_SAMPLES];
+  int status[RSS_NODE_SAMPLES];
+  size_t *node_counts;
+} rss_scratch;
+
+static int pagemap_fd;
+static size_t pagesize;
+static int num_nodes;
+
+/* A copy of `rss_extents`, only updated when `extents_version` changes. Each
+ * extent has `num_nodes` elements of `node_pages`.
+ */
+static rss_extent *rss_arr;
+static size_t *node_pages;
+static size_t num_rss, max_rss, rss_version;
+static size_t cursor; /* Where the round-robin rescan picks up */
+
+/* The indices into `rss_arr` to scan this pass */
+static size_t *work;
+static size_t num_work, next_work;
+
+static int num_threads;
+static pthread_t *threads;
+static rss_scratch *scratch;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static size_t pass;
+static int busy, stopping;
+
+/* Reads the pagemap entries of `num` pages from page `first` of an extent.
+ * Returns how many are resident, and saves the first one of them as a node
+ * sample.
+ */
+static size_t scan_run(rss_extent *e, size_t first, size_t num, rss_scratch *s, size_t *num_samples) {
+  size_t i, present;
+  uint64_t page;
+
+  page = (e->start / pagesize) + first;
+  if(pread(pagemap_fd, s->entries, num * sizeof(uint64_t), page * sizeof(uint64_t)) != num * sizeof(uint64_t)) {
+    fprintf(stderr, "Failed to read the PageMap file. Aborting.\n");
+    exit(1);
+  }
+  present = 0;
+  for(i = 0; i < num; i++) {
+    if(!(s->entries[i] & PAGEMAP_PRESENT)) continue;
+    if(!present && (*num_samples < RSS_NODE_SAMPLES)) {
+      s->pages[(*num_samples)++] = (void *) ((page + i) * pagesize);
+    }
+    present++;
+  }
+  return present;
+}
+
+/* Updates an extent's resident pages, and how they're split among the nodes */
+static void scan_extent(size_t index, rss_scratch *s) {
+  size_t numpages, scanned, present, num_samples, found, runs, stride, shift, i, k;
+  size_t *nodes;
+  rss_extent *e;
+
+  e = &rss_arr[index];
+  nodes = &node_pages[index * num_nodes];
+  numpages = (e->end - e->start) / pagesize;
+  num_samples = 0;
+  found = 0;
+
+  if(numpages <= RSS_SAMPLE_PAGES) {
+    for(i = 0; i < numpages; i += RSS_RUN_PAGES) {
+      found += scan_run(e, i, (numpages - i < RSS_RUN_PAGES) ? numpages - i : RSS_RUN_PAGES, s, &num_samples);
+    }
+    scanned = numpages;
+  } else {
+    runs = RSS_SAMPLE_PAGES / RSS_RUN_PAGES;
+    stride = numpages / runs;
+    shift = e->offset % (stride - RSS_RUN_PAGES + 1);
+    for(k = 0; k < runs; k++) {
+      found += scan_run(e, (k * stride) + shift, RSS_RUN_PAGES, s, &num_samples);
+    }
+    e->offset += RSS_RUN_PAGES;
+    scanned = runs * RSS_RUN_PAGES;
+  }
+  present = scanned ? (found * numpages) / scanned : 0;
+  e->present = present;
+  e->stale = 0;
+
+  /* With no nodes given, move_pages just says where each page is */
+  memset(nodes, 0, num_nodes * sizeof(size_t));
+  if(!num_samples || (move_pages(0, num_samples, s->pages, NULL, s->status, 0) != 0)) {
+    return;
+  }
+  memset(s->node_counts, 0, num_nodes * sizeof(size_t));
+  found = 0;
+  for(i = 0; i < num_samples; i++) {
+    if((s->status[i] < 0) || (s->status[i] >= num_nodes)) continue;
+    s->node_counts[s->status[i]]++;
+    found++;
+  }
+  for(i = 0; found && (i < num_nodes); i++) {
+    nodes[i] = (present * s->node_counts[i]) / found;
+  }
+}
+
+static void do_work(rss_scratch *s) {
+  size_t i;
+
+  while((i = __atomic_fetch_add(&next_work, 1, __ATOMIC_RELAXED)) < num_work) {
+    scan_extent(work[i], s);
+  }
+}
+
+static void *rss_worker(void *a) {
+  rss_scratch *s;
+  size_t seen;
+
+  sh_internal_thread = 1;
+
+  s = (rss_scratch *) a;
+  seen = 0;
+  pthread_mutex_lock(&lock);
+  while(1) {
+    while((pass == seen) && !stopping) {
+      pthread_cond_wait(&start_cond, &lock);
+    }
+    if(stopping) break;
+    seen = pass;
+    pthread_mutex_unlock(&lock);
+
+    do_work(s);
+
+    pthread_mutex_lock(&lock);
+    if(--busy == 0) {
+      pthread_cond_signal(&done_cond);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  return NULL;
+}
+
+/* Copies any new extents out of `rss_extents`, so that the scan doesn't need
+ * to hold `extents_lock`. Extents aren't removed, so the ones that we have
+ * stay valid.
+ */
+static void sync_extents() {
+  rss_extent *e;
+  size_t i;
+
+  pthread_rwlock_rdlock(&extents_lock);
+  if(rss_arr && (rss_version == extents_version)) {
+    pthread_rwlock_unlock(&extents_lock);
+    return;
+  }
+  if(rss_extents->index > max_rss) {
+    max_rss = rss_extents->index * 2;
+    rss_arr = (rss_extent *) realloc(rss_arr, max_rss * sizeof(rss_extent));
+    node_pages = (size_t *) realloc(node_pages, max_rss * num_nodes * sizeof(size_t));
+    work = (size_t *) realloc(work, max_rss * sizeof(size_t));
+  }
+  extent_arr_for(rss_extents, i) {
+    e = &rss_arr[i];
+    if((i < num_rss) &&
+       (e->start == (uint64_t) rss_extents->arr[i].start) &&
+       (e->end == (uint64_t) rss_extents->arr[i].end)) {
+      continue;
+    }
+    e->start = (uint64_t) rss_extents->arr[i].start;
+    e->end = (uint64_t) rss_extents->arr[i].end;
+    e->arena = (arena_info *) rss_extents->arr[i].arena;
+    e->present = 0;
+    e->offset = 0;
+    e->stale = (e->start || e->end);
+    memset(&node_pages[i * num_nodes], 0, num_nodes * sizeof(size_t));
+  }
+  num_rss = rss_extents->index;
+  rss_version = extents_version;
+  pthread_rwlock_unlock(&extents_lock);
+}
+
+/* Chooses the extents to scan this pass: the new ones, then the others
+ * round-robin until the pass has looked at RSS_PASS_PAGES pages.
+ */
+static void choose_work() {
+  size_t i, n, budget, cost;
+  rss_extent *e;
+
+  num_work = 0;
+  for(i = 0; i < num_rss; i++) {
+    if(rss_arr[i].stale) {
+      work[num_work++] = i;
+    }
+  }
+
+  budget = RSS_PASS_PAGES;
+  for(n = 0; (n < num_rss) && budget; n++) {
+    if(cursor >= num_rss) {
+      cursor = 0;
+    }
+    e = &rss_arr[cursor];
+    if(!e->stale && (e->start || e->end)) {
+      cost = (e->end - e->start) / pagesize;
+      if(cost > RSS_SAMPLE_PAGES) {
+        cost = RSS_SAMPLE_PAGES;
+      }
+      work[num_work++] = cursor;
+      budget = (cost < budget) ? budget - cost : 0;
+    }
+    cursor++;
+  }
+}
+
+void sh_rss_init(int threads_wanted) {
+  int i;
+
+  pagesize = (size_t) sysconf(_SC_PAGESIZE);
+  num_nodes = numa_max_node() + 1;
+  rss_arr = NULL;
+  node_pages = NULL;
+  work = NULL;
+  num_rss = 0;
+  max_rss = 0;
+  cursor = 0;
+
+  pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+  if(pagemap_fd < 0) {
+    fprintf(stderr, "Failed to open /proc/self/pagemap. Aborting.\n");
+    exit(1);
+  }
+
+  /* This thread scans too, so it has the first scratch buffers */
+  num_threads = (threads_wanted > 0) ? threads_wanted : 1;
+  scratch = (rss_scratch *) malloc(num_threads * sizeof(rss_scratch));
+  threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+  pass = 0;
+  stopping = 0;
+  for(i = 0; i < num_threads; i++) {
+    scratch[i].node_counts = (size_t *) malloc(num_nodes * sizeof(size_t));
+    if(i) {
+      pthread_create(&threads[i], NULL, &rss_worker, &scratch[i]);
+    }
+  }
+}
+
+/* Updates every arena's RSS, and its RSS on each node */
+void sh_rss_scan() {
+  arena_info *arena;
+  size_t i, *nodes;
+  int n;
+
+  sync_extents();
+  choose_work();
+
+  next_work = 0;
+  pthread_mutex_lock(&lock);
+  busy = num_threads - 1;
+  pass++;
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&lock);
+  do_work(&scratch[0]);
+  pthread_mutex_lock(&lock);
+  while(busy) {
+    pthread_cond_wait(&done_cond, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+
+  /* Zero out the RSS values for each arena, then add up its extents */
+  for(i = 0; i < num_rss; i++) {
+    arena = rss_arr[i].arena;
+    if(!arena) continue;
+    if(!arena->node_rss) {
+      arena->node_rss = (size_t *) calloc(num_nodes, sizeof(size_t));
+      arena->peak_node_rss = (size_t *) calloc(num_nodes, sizeof(size_t));
+    }
+    arena->rss = 0;
+    memset(arena->node_rss, 0, num_nodes * sizeof(size_t));
+  }
+  for(i = 0; i < num_rss; i++) {
+    arena = rss_arr[i].arena;
+    if(!arena) continue;
+    arena->rss += rss_arr[i].present * pagesize;
+    nodes = &node_pages[i * num_nodes];
+    for(n = 0; n < num_nodes; n++) {
+      arena->node_rss[n] += nodes[n] * pagesize;
+    }
+  }
+
+  /* Maintain the peaks */
+  for(i = 0; i < num_rss; i++) {
+    arena = rss_arr[i].arena;
+    if(!arena) continue;
+    if(arena->rss > arena->peak_rss) {
+      arena->peak_rss = arena->rss;
+    }
+    for(n = 0; n < num_nodes; n++) {
+      if(arena->node_rss[n] > arena->peak_node_rss[n]) {
+        arena->peak_node_rss[n] = arena->node_rss[n];
+      }
+    }
+  }
+}
+
+/* Prints the peak RSS of an arena on each node that it was seen on */
+void sh_rss_print_nodes(arena_info *arena) {
+  int n;
+
+  if(!arena->peak_node_rss) return;
+  for(n = 0; n < num_nodes; n++) {
+    if(arena->peak_node_rss[n]) {
+      printf("  Peak RSS on node %d: %zu\n", n, arena->peak_node_rss[n]);
+    }
+  }
+}
+
+void sh_rss_terminate() {
+  int i;
+
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&lock);
+  for(i = 1; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  for(i = 0; i < num_threads; i++) {
+    free(scratch[i].node_counts);
+  }
+  free(scratch);
+  free(threads);
+  free(rss_arr);
+  free(node_pages);
+  free(work);
+  close(pagemap_fd);
+}
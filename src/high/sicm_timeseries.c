@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sicm_high.h"
+#include "sicm_timeseries.h"
+
+/* Records go into `fill` while the writer writes out `drain`. The writer
+ * swaps them when `fill` is full, or when it's time to flush.
+ */
+static timeseries_record *fill, *drain;
+static size_t fill_count;
+static int stopping;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t full_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_id;
+static FILE *output;
+static struct timespec start;
+
+uint64_t sh_timeseries_now() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t) (now.tv_sec - start.tv_sec) * 1000) +
+         ((now.tv_nsec - start.tv_nsec) / 1000000);
+}
+
+static void write_records(timeseries_record *records, size_t num) {
+  size_t i;
+
+  for(i = 0; i < num; i++) {
+    fprintf(output, "%" PRIu64 ",%u,%zu,%zu,%.2f,%d,%u,%zu,%zu,%zu\n",
+            records[i].time_ms, records[i].site, records[i].accesses,
+            records[i].rss, records[i].bandwidth, records[i].node, records[i].phase,
+            records[i].reads, records[i].writes, records[i].weight);
+  }
+  fflush(output);
+}
+
+static void *timeseries_writer(void *a) {
+  timeseries_record *tmp;
+  struct timespec deadline;
+  size_t num;
+  int done;
+
+  sh_internal_thread = 1;
+
+  pthread_mutex_lock(&lock);
+  while(1) {
+    if(!stopping && (fill_count < TIMESERIES_BUFFER_SIZE)) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += TIMESERIES_FLUSH_SECONDS;
+      pthread_cond_timedwait(&full_cond, &lock, &deadline);
+    }
+
+    /* Take the full buffer, and let the profiling threads fill the other */
+    tmp = fill;
+    fill = drain;
+    drain = tmp;
+    num = fill_count;
+    fill_count = 0;
+    done = stopping;
+    pthread_cond_broadcast(&space_cond);
+    pthread_mutex_unlock(&lock);
+
+    write_records(drain, num);
+
+    pthread_mutex_lock(&lock);
+    /* The profiling threads have been joined by the time we're stopped */
+    if(done) break;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return NULL;
+}
+
+void sh_timeseries_start(const char *path) {
+  output = fopen(path, "w");
+  if(!output) {
+    fprintf(stderr, "Failed to open profiling output file %s. Aborting.\n", path);
+    exit(1);
+  }
+  fprintf(output, "%s\n", TIMESERIES_HEADER);
+  fflush(output);
+
+  fill = (timeseries_record *) malloc(TIMESERIES_BUFFER_SIZE * sizeof(timeseries_record));
+  drain = (timeseries_record *) malloc(TIMESERIES_BUFFER_SIZE * sizeof(timeseries_record));
+  fill_count = 0;
+  stopping = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_create(&writer_id, NULL, &timeseries_writer, NULL);
+}
+
+/* Copies a record into the buffer. Only waits if the writer has fallen a
+ * whole buffer behind.
+ */
+void sh_timeseries_record(timeseries_record *record) {
+  pthread_mutex_lock(&lock);
+  while(fill_count == TIMESERIES_BUFFER_SIZE) {
+    pthread_cond_signal(&full_cond);
+    pthread_cond_wait(&space_cond, &lock);
+  }
+  fill[fill_count++] = *record;
+  if(fill_count == TIMESERIES_BUFFER_SIZE) {
+    pthread_cond_signal(&full_cond);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/* Writes out what's left and closes the file. Call after the profiling
+ * threads have stopped.
+ */
+void sh_timeseries_stop() {
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_signal(&full_cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(writer_id, NULL);
+
+  fclose(output);
+  free(fill);
+  free(drain);
+}
@@ -21,6 +21,43 @@ static pthread_key_t sa_default_key;
 static extent_hooks_t sa_hooks;
 void (*sicm_extent_alloc_callback)(void *start, void *end) = NULL;
 
+// sarenas indexed by jemalloc arena index, so that sarena_ptr2sarena doesn't
+// have to walk sa_list. Chunks are allocated on first use and never freed.
+#define SA_CHUNK_SHIFT	10
+#define SA_CHUNK_SIZE	(1 << SA_CHUNK_SHIFT)
+#define SA_MAX_CHUNKS	4096
+static sarena **sa_table[SA_MAX_CHUNKS];
+
+// should be called with sa_mutex held
+static void sa_table_set(unsigned arena_ind, sarena *sa) {
+	sarena **chunk;
+
+	if ((arena_ind >> SA_CHUNK_SHIFT) >= SA_MAX_CHUNKS)
+		return;
+
+	chunk = sa_table[arena_ind >> SA_CHUNK_SHIFT];
+	if (chunk == NULL) {
+		chunk = calloc(SA_CHUNK_SIZE, sizeof(sarena *));
+		if (chunk == NULL)
+			return;
+		__atomic_store_n(&sa_table[arena_ind >> SA_CHUNK_SHIFT], chunk, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&chunk[arena_ind & (SA_CHUNK_SIZE - 1)], sa, __ATOMIC_RELEASE);
+}
+
+static sarena *sa_table_get(unsigned arena_ind) {
+	sarena **chunk;
+
+	if ((arena_ind >> SA_CHUNK_SHIFT) >= SA_MAX_CHUNKS)
+		return NULL;
+
+	chunk = __atomic_load_n(&sa_table[arena_ind >> SA_CHUNK_SHIFT], __ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+		return NULL;
+
+	return __atomic_load_n(&chunk[arena_ind & (SA_CHUNK_SIZE - 1)], __ATOMIC_ACQUIRE);
+}
+
 static void sarena_init() {
 	int err;
 	size_t miblen;
@@ -32,6 +69,15 @@ static void sarena_init() {
 		fprintf(stderr, "can't get mib: %d\n", err);
 }
 
+// get the index of the jemalloc arena that ptr was allocated from
+static int sa_ptr2ind(void *ptr, unsigned *arena_ind) {
+	size_t ai_sz;
+
+	pthread_once(&sa_init, sarena_init);
+	ai_sz = sizeof(unsigned);
+	return je_mallctlbymib(sa_lookup_mib, 2, arena_ind, &ai_sz, &ptr, sizeof(ptr));
+}
+
 // check if all devices use NUMA and if they are have the same page size
 static struct bitmask *sicm_device_list_check_numa(sicm_device_list *devs) {
 	int i, cpgsz;
@@ -140,6 +186,7 @@ static sarena *sicm_arena_new(size_t sz, sicm_arena_flags flags, sicm_device_lis
 	sa->next = sa_list;
 	sa_list = sa;
 	sa_num++;
+	sa_table_set(arena_ind, sa);
 	pthread_mutex_unlock(&sa_mutex);
 
 	return sa;
@@ -156,12 +203,25 @@ sicm_arena sicm_arena_create_mmapped(size_t sz, sicm_arena_flags flags, sicm_dev
 
 void sicm_arena_destroy(sicm_arena arena) {
 	sarena *sa = arena;
+	sarena **prev;
 	char str[32];
 	size_t arena_ind_sz;
 
 	if (sa == NULL)
 		return;
 
+	// remove the arena from the global list of arenas
+	pthread_mutex_lock(&sa_mutex);
+	for(prev = &sa_list; *prev != NULL; prev = &(*prev)->next) {
+		if (*prev == sa) {
+			*prev = sa->next;
+			sa_num--;
+			break;
+		}
+	}
+	sa_table_set(sa->arena_ind, NULL);
+	pthread_mutex_unlock(&sa_mutex);
+
 	/* Free up the arena */
 	snprintf(str, sizeof(str), "arena.%u.destroy", sa->arena_ind);
 	arena_ind_sz = sizeof(unsigned);
@@ -347,9 +407,40 @@ void *sicm_arena_alloc_aligned(sicm_arena a, size_t sz, size_t align) {
 	return je_mallocx(sz, flags);
 }
 
+void *sicm_arena_calloc(sicm_arena a, size_t num, size_t sz) {
+	sarena *sa;
+	int flags;
+	size_t total;
+
+	if (__builtin_mul_overflow(num, sz, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (total == 0) {
+		return je_malloc(0);
+	}
+
+	// MALLOCX_ZERO lets jemalloc skip zeroing extents that sa_alloc
+	// reports as already zeroed
+	sa = a;
+	flags = MALLOCX_ZERO;
+	if (sa != NULL) {
+		flags |= MALLOCX_ARENA(sa->arena_ind) | MALLOCX_TCACHE_NONE;
+	}
+
+	return je_mallocx(total, flags);
+}
+
 void *sicm_arena_realloc(sicm_arena a, void *ptr, size_t sz) {
 	sarena *sa;
 	int flags;
+	unsigned arena_ind;
+	size_t old_sz;
+	void *ret;
+
+	if (ptr == NULL)
+		return sicm_arena_alloc(a, sz);
 
 	if (sz == 0) {
 		sicm_free(ptr);
@@ -357,11 +448,28 @@ void *sicm_arena_realloc(sicm_arena a, void *ptr, size_t sz) {
 	}
 
 	sa = a;
-	flags = 0;
-	if (sa != NULL)
-		flags = MALLOCX_ARENA(sa->arena_ind) | MALLOCX_TCACHE_NONE;
+	if (sa == NULL)
+		return je_rallocx(ptr, sz, 0);
+
+	flags = MALLOCX_ARENA(sa->arena_ind) | MALLOCX_TCACHE_NONE;
+	if (sa_ptr2ind(ptr, &arena_ind) != 0 || arena_ind == sa->arena_ind) {
+		// already in the right arena: try to resize in place before
+		// letting rallocx copy
+		if (je_xallocx(ptr, sz, 0, flags) >= sz)
+			return ptr;
+		return je_rallocx(ptr, sz, flags);
+	}
+
+	// the memory lives in another arena; rallocx would keep it there if
+	// it could resize in place, so copy it into this arena instead
+	ret = je_mallocx(sz, flags);
+	if (ret == NULL)
+		return NULL;
+	old_sz = je_sallocx(ptr, 0);
+	memcpy(ret, ptr, old_sz < sz ? old_sz : sz);
+	je_free(ptr);
 
-	return je_rallocx(ptr, sz, flags);
+	return ret;
 }
 
 void *sicm_alloc(size_t sz) {
@@ -395,8 +503,14 @@ void sicm_free(void *ptr) {
 }
 
 void *sicm_realloc(void *ptr, size_t sz) {
-	// TODO: should we include MALLOCX_ARENA(...)???
-	return je_rallocx(ptr, sz, MALLOCX_TCACHE_NONE);
+	sarena *sa;
+
+	if (ptr == NULL)
+		return sicm_alloc(sz);
+
+	// keep the memory in the arena that it came from
+	sa = sarena_ptr2sarena(ptr);
+	return sicm_arena_realloc(sa, ptr, sz);
 }
 
 void sicm_arena_set_default(sicm_arena sa) {
@@ -413,27 +527,14 @@ sicm_arena sicm_arena_get_default(void) {
 sarena *sarena_ptr2sarena(void *ptr) {
 	int err;
 	unsigned arena_ind;
-	size_t ai_sz;
-	sarena *sa;
 
-	sa = NULL;
-	ai_sz = sizeof(unsigned);
-	err = je_mallctlbymib(sa_lookup_mib, 2, &arena_ind, &ai_sz, &ptr, sizeof(ptr));
+	err = sa_ptr2ind(ptr, &arena_ind);
 	if (err != 0) {
-		fprintf(stderr, "can't setup hooks: %d\n", err);
-		goto out;
-	}
-
-	// TODO: make this lookup faster if this becomes bottleneck
-	pthread_mutex_lock(&sa_mutex);
-	for(sa = sa_list; sa != NULL; sa = sa->next) {
-		if (sa->arena_ind == arena_ind)
-			break;
+		fprintf(stderr, "can't look up arena: %d\n", err);
+		return NULL;
 	}
-	pthread_mutex_unlock(&sa_mutex);
 
-out:
-	return sa;
+	return sa_table_get(arena_ind);
 }
 
 sicm_arena sicm_arena_lookup(void *ptr) {
@@ -556,6 +657,10 @@ success:
 		size -= alignment;
 	}
 
+	// fresh anonymous pages are zero-filled by the kernel
+	if (sa->fd == -1)
+		*zero = 1;
+
 	/* Add the extent to the array of extents */
 	extent_arr_insert(sa->extents, ret, (char *)ret + size, NULL);
 
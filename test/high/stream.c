@@ -47,6 +47,9 @@
 # include <float.h>
 # include <limits.h>
 # include <sys/time.h>
+#ifdef PLACEMENT_MATRIX
+# include <sicm_low.h>
+#endif
 
 /*-----------------------------------------------------------------------
  * INSTRUCTIONS:
@@ -125,6 +128,19 @@
 #   define OFFSET	0
 #endif
 
+/*  SICM: compiling with -DPLACEMENT_MATRIX adds a second phase after the
+ *         normal run. Each of the a, b and c arrays comes from its own
+ *         allocation site, so with a per-site arena layout
+ *         (SH_ARENA_LAYOUT=SHARED_SITE_ARENAS) each array has its own arena.
+ *         The matrix phase rebinds those three arenas to every combination
+ *         of the available NUMA devices, reruns the kernels MATRIX_NTIMES
+ *         times for each combination, and prints the best rate of each
+ *         kernel per placement.
+ */
+#ifndef MATRIX_NTIMES
+#   define MATRIX_NTIMES	10
+#endif
+
 /*
  *	3) Compile the code with optimization.  Many compilers generate
  *       unreasonably bad code before the optimizer tightens things up.  
@@ -196,6 +212,9 @@ static double	bytes[4] = {
 
 extern double mysecond();
 extern void checkSTREAMresults();
+#ifdef PLACEMENT_MATRIX
+extern void placementMatrix();
+#endif
 #ifdef TUNED
 extern void tuned_STREAM_Copy();
 extern void tuned_STREAM_Scale(STREAM_TYPE scalar);
@@ -379,6 +398,11 @@ main()
     checkSTREAMresults();
     printf(HLINE);
 
+#ifdef PLACEMENT_MATRIX
+    placementMatrix();
+    printf(HLINE);
+#endif
+
     return 0;
 }
 
@@ -552,6 +576,154 @@ void checkSTREAMresults ()
 #endif
 }
 
+#ifdef PLACEMENT_MATRIX
+/* Runs every assignment of the a, b and c arenas across the devices that
+ * share the arenas' page size, and reports the best rate of each kernel
+ * for each assignment.
+ */
+void placementMatrix()
+{
+	sicm_device_list	devs, orig[3];
+	sicm_device		**nodes;
+	sicm_arena		arenas[3];
+	int			num_nodes, num_placements, page_size;
+	int			i, k, n, p, err;
+	int			*placement;
+	char			*skipped;
+	double			t, *rates[4];
+	ssize_t			j;
+	STREAM_TYPE		scalar;
+
+	/* Every array needs an arena of its own */
+	arenas[0] = sicm_arena_lookup(a);
+	arenas[1] = sicm_arena_lookup(b);
+	arenas[2] = sicm_arena_lookup(c);
+	if (!arenas[0] || !arenas[1] || !arenas[2] ||
+	    arenas[0] == arenas[1] || arenas[0] == arenas[2] || arenas[1] == arenas[2]) {
+		printf("Placement matrix skipped: a, b and c don't have separate arenas.\n");
+		printf("Run with a per-site layout, e.g. SH_ARENA_LAYOUT=SHARED_SITE_ARENAS.\n");
+		return;
+	}
+
+	/* Remember where the arrays were, to put them back afterwards */
+	for (i = 0; i < 3; i++)
+		orig[i] = sicm_arena_get_devices(arenas[i]);
+
+	/* Only consider devices that the arenas can actually be moved to.
+	 * sicm_init is reference counted, so this is the runtime's own device
+	 * list; sicm_fini drops our reference to it.
+	 */
+	page_size = sicm_device_page_size(orig[0].devices[0]);
+	devs = sicm_init();
+	nodes = malloc(sizeof(sicm_device *) * devs.count);
+	num_nodes = 0;
+	for (i = 0; i < devs.count; i++) {
+		if (sicm_numa_id(devs.devices[i]) < 0 ||
+		    sicm_device_page_size(devs.devices[i]) != page_size)
+			continue;
+		nodes[num_nodes++] = devs.devices[i];
+	}
+
+	num_placements = num_nodes * num_nodes * num_nodes;
+	placement = malloc(sizeof(int) * 3 * num_placements);
+	skipped = calloc(num_placements, sizeof(char));
+	for (k = 0; k < 4; k++)
+		rates[k] = calloc(num_placements, sizeof(double));
+
+	printf("Placement matrix: %d devices, %d placements, %d iterations each.\n",
+		num_nodes, num_placements, MATRIX_NTIMES);
+
+	scalar = 3.0;
+	for (p = 0; p < num_placements; p++) {
+		placement[3*p + 0] = p / (num_nodes * num_nodes);
+		placement[3*p + 1] = (p / num_nodes) % num_nodes;
+		placement[3*p + 2] = p % num_nodes;
+
+		/* Rebind the arenas; this migrates the arrays' pages */
+		err = 0;
+		for (i = 0; i < 3; i++) {
+			if (sicm_arena_set_device(arenas[i], nodes[placement[3*p + i]]) != 0)
+				err = 1;
+		}
+		if (err) {
+			printf("Failed to move to a:%d b:%d c:%d, skipping.\n",
+				sicm_numa_id(nodes[placement[3*p + 0]]),
+				sicm_numa_id(nodes[placement[3*p + 1]]),
+				sicm_numa_id(nodes[placement[3*p + 2]]));
+			skipped[p] = 1;
+			continue;
+		}
+
+#pragma omp parallel for
+		for (j=0; j<STREAM_ARRAY_SIZE; j++) {
+			a[j] = 1.0;
+			b[j] = 2.0;
+			c[j] = 0.0;
+		}
+
+		for (n = 0; n < MATRIX_NTIMES; n++) {
+			t = mysecond();
+#pragma omp parallel for
+			for (j=0; j<STREAM_ARRAY_SIZE; j++)
+				c[j] = a[j];
+			t = mysecond() - t;
+			if (n > 0) rates[0][p] = MAX(rates[0][p], 1.0E-06 * bytes[0]/t);
+
+			t = mysecond();
+#pragma omp parallel for
+			for (j=0; j<STREAM_ARRAY_SIZE; j++)
+				b[j] = scalar*c[j];
+			t = mysecond() - t;
+			if (n > 0) rates[1][p] = MAX(rates[1][p], 1.0E-06 * bytes[1]/t);
+
+			t = mysecond();
+#pragma omp parallel for
+			for (j=0; j<STREAM_ARRAY_SIZE; j++)
+				c[j] = a[j]+b[j];
+			t = mysecond() - t;
+			if (n > 0) rates[2][p] = MAX(rates[2][p], 1.0E-06 * bytes[2]/t);
+
+			t = mysecond();
+#pragma omp parallel for
+			for (j=0; j<STREAM_ARRAY_SIZE; j++)
+				a[j] = b[j]+scalar*c[j];
+			t = mysecond() - t;
+			if (n > 0) rates[3][p] = MAX(rates[3][p], 1.0E-06 * bytes[3]/t);
+		}
+	}
+
+	/* Put the arrays back where they started */
+	for (i = 0; i < 3; i++) {
+		if (sicm_arena_set_device_list(arenas[i], &orig[i]) != 0)
+			printf("Failed to move array %c back to its original device.\n", 'a' + i);
+		sicm_device_list_free(&orig[i]);
+	}
+
+	/* One matrix per kernel: a row per placement, best rate in MB/s */
+	for (k = 0; k < 4; k++) {
+		printf(HLINE);
+		printf("%s   a    b    c   Best Rate MB/s\n", label[k]);
+		for (p = 0; p < num_placements; p++) {
+			printf("           %4d %4d %4d   ",
+				sicm_numa_id(nodes[placement[3*p + 0]]),
+				sicm_numa_id(nodes[placement[3*p + 1]]),
+				sicm_numa_id(nodes[placement[3*p + 2]]));
+			if (skipped[p])
+				printf("%12s\n", "n/a");
+			else
+				printf("%12.1f\n", rates[k][p]);
+		}
+	}
+
+	for (k = 0; k < 4; k++)
+		free(rates[k]);
+	free(skipped);
+	free(placement);
+	free(nodes);
+	sicm_fini();
+}
+#endif
+
 #ifdef TUNED
 /* stubs for "tuned" versions of the kernels */
 void tuned_STREAM_Copy()